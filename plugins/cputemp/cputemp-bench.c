@@ -0,0 +1,708 @@
+/*
+ * Headless benchmark of the CPU temperature plugin's sampling and drawing
+ *
+ * Usage: cputemp-bench [iterations]
+ *
+ * The plugin source is built into the benchmark, so that the sampling and
+ * drawing functions can be driven directly, without a panel or a display.
+ * Sensors are plain files in a temporary directory, and the graph is drawn
+ * to the plugin's own offscreen image surfaces.
+ *
+ * Output is one tab-separated line per case, after a header line starting
+ * with '#': the stage, read backend, sensor count, graph size and sensor
+ * view, then the median and 99th percentile time per call in microseconds,
+ * and the mean number of system calls and heap allocations per call. Fields
+ * which don't apply to a stage are given as '-'.
+ *
+ * Before the bar rasteriser is timed, its vector and scalar paths are
+ * checked to draw identical pixels; the benchmark fails if they do not. The
+ * cairo strokes it replaced are timed drawing the same graph, as
+ * raster_cairo, for comparison.
+ *
+ * System calls are counted in the libc wrappers the plugin uses (read,
+ * pread, open, close, write, ioctl and syscall), which are interposed here;
+ * allocations are counted by interposing malloc and friends, and so include
+ * those made inside GLib and cairo.
+ *
+ * Once the graph has been filled and drawn, heap memory in use must not grow
+ * while the plugin takes in samples and redraws; the benchmark fails if it
+ * does, as the plugin would grow over a long run.
+ */
+
+/*
+Copyright (c) 2018 Raspberry Pi (Trading) Ltd.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the
+      names of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <dlfcn.h>
+#include <malloc.h>
+#include <stdarg.h>
+#include <glib/gstdio.h>
+#include <gtk/gtk.h>
+
+/* Nothing is shown, so the widget calls made while drawing are dropped */
+#define gtk_widget_queue_draw(w) ((void) (w))
+#define gtk_widget_set_size_request(w, x, y) ((void) (w))
+
+#include "cputemp.c"
+
+#define DEFAULT_ITERATIONS 1000
+
+static const int bench_sensors[] = { 1, 4, 16, 32 };
+static const int bench_icon_sizes[] = { 24, 36, 48, 72 };
+
+/* Counters */
+
+static guint64 bench_syscalls;
+static guint64 bench_allocs;
+static gint64 bench_live;                   /* Heap bytes allocated through the counters and not freed */
+
+extern void *__libc_malloc (size_t size);
+extern void *__libc_calloc (size_t n, size_t size);
+extern void *__libc_realloc (void *ptr, size_t size);
+extern void *__libc_memalign (size_t align, size_t size);
+extern void __libc_free (void *ptr);
+
+static void *bench_alloced (void *ptr)
+{
+    bench_allocs++;
+    if (ptr) bench_live += malloc_usable_size (ptr);
+    return ptr;
+}
+
+void *malloc (size_t size)
+{
+    return bench_alloced (__libc_malloc (size));
+}
+
+void *calloc (size_t n, size_t size)
+{
+    return bench_alloced (__libc_calloc (n, size));
+}
+
+void *realloc (void *ptr, size_t size)
+{
+    size_t old = ptr ? malloc_usable_size (ptr) : 0;
+    void *res = __libc_realloc (ptr, size);
+
+    /* A failed realloc leaves the old block in place */
+    if (res || !size) bench_live -= old;
+    return res ? bench_alloced (res) : res;
+}
+
+int posix_memalign (void **ptr, size_t align, size_t size)
+{
+    if (!(*ptr = bench_alloced (__libc_memalign (align, size)))) return ENOMEM;
+    return 0;
+}
+
+void free (void *ptr)
+{
+    if (ptr) bench_live -= malloc_usable_size (ptr);
+    __libc_free (ptr);
+}
+
+#define BENCH_REAL(name) \
+    static __typeof__ (name) *real; \
+    if (!real) real = (__typeof__ (name) *) dlsym (RTLD_NEXT, #name); \
+    bench_syscalls++
+
+ssize_t read (int fd, void *buf, size_t len)
+{
+    BENCH_REAL (read);
+    return real (fd, buf, len);
+}
+
+ssize_t pread (int fd, void *buf, size_t len, off_t offset)
+{
+    BENCH_REAL (pread);
+    return real (fd, buf, len, offset);
+}
+
+ssize_t write (int fd, const void *buf, size_t len)
+{
+    BENCH_REAL (write);
+    return real (fd, buf, len);
+}
+
+int close (int fd)
+{
+    BENCH_REAL (close);
+    return real (fd);
+}
+
+int open (const char *path, int flags, ...)
+{
+    va_list ap;
+    mode_t mode;
+
+    va_start (ap, flags);
+    mode = (flags & O_CREAT) ? va_arg (ap, mode_t) : 0;
+    va_end (ap);
+
+    BENCH_REAL (open);
+    return real (path, flags, mode);
+}
+
+int ioctl (int fd, unsigned long request, ...)
+{
+    va_list ap;
+    void *arg;
+
+    va_start (ap, request);
+    arg = va_arg (ap, void *);
+    va_end (ap);
+
+    BENCH_REAL (ioctl);
+    return real (fd, request, arg);
+}
+
+#ifdef HAVE_LINUX_IO_URING_H
+/* Only the io_uring calls made by the plugin are passed on, each with the
+ * arguments it takes, as reading more than were passed is undefined */
+long syscall (long number, ...)
+{
+    va_list ap;
+    long ret;
+    int fd;
+    unsigned a, b, c;
+    void *p;
+
+    BENCH_REAL (syscall);
+    va_start (ap, number);
+    switch (number)
+    {
+        case __NR_io_uring_setup :
+            a = va_arg (ap, unsigned);
+            p = va_arg (ap, void *);
+            ret = real (number, a, p);
+            break;
+
+        case __NR_io_uring_enter :
+        {
+            int size;
+
+            fd = va_arg (ap, int);
+            a = va_arg (ap, unsigned);
+            b = va_arg (ap, unsigned);
+            c = va_arg (ap, unsigned);
+            p = va_arg (ap, void *);
+            size = va_arg (ap, int);
+            ret = real (number, fd, a, b, c, p, size);
+            break;
+        }
+
+        case __NR_io_uring_register :
+            fd = va_arg (ap, int);
+            a = va_arg (ap, unsigned);
+            p = va_arg (ap, void *);
+            b = va_arg (ap, unsigned);
+            ret = real (number, fd, a, p, b);
+            break;
+
+        default :
+            errno = ENOSYS;
+            ret = -1;
+            break;
+    }
+    va_end (ap);
+    return ret;
+}
+#endif
+
+/* Panel functions used by the plugin */
+
+static CPUTempPlugin *bench_plugin;
+static gint bench_icon_size;
+
+gpointer lxpanel_plugin_get_data (GtkWidget *plugin)
+{
+    return bench_plugin;
+}
+
+void lxpanel_plugin_set_data (GtkWidget *plugin, gpointer data, GDestroyNotify destructor)
+{
+}
+
+gint panel_get_icon_size (LXPanel *panel)
+{
+    return bench_icon_size;
+}
+
+gboolean config_setting_lookup_int (const config_setting_t *setting, const char *name, int *value)
+{
+    return FALSE;
+}
+
+gboolean config_setting_lookup_string (const config_setting_t *setting, const char *name, const char **value)
+{
+    return FALSE;
+}
+
+config_setting_t *config_group_set_int (config_setting_t *setting, const char *name, int value)
+{
+    return NULL;
+}
+
+config_setting_t *config_group_set_string (config_setting_t *setting, const char *name, const char *value)
+{
+    return NULL;
+}
+
+GtkWidget *lxpanel_generic_config_dlg (const char *title, LXPanel *panel, GSourceFunc apply_func, GtkWidget *plugin, const char *name, ...)
+{
+    return NULL;
+}
+
+/* Timing */
+
+typedef struct
+{
+    gint64 *time;                           /* Time of each call, in ns */
+    guint count;                            /* Number of calls timed */
+    guint64 syscalls;                       /* System calls made by all calls */
+    guint64 allocs;                         /* Allocations made by all calls */
+    struct timespec start;
+    guint64 start_syscalls, start_allocs;
+} BenchRun;
+
+static guint iterations = DEFAULT_ITERATIONS;
+
+static void run_init (BenchRun *r)
+{
+    memset (r, 0, sizeof (*r));
+    r->time = g_new (gint64, iterations);
+}
+
+static void run_start (BenchRun *r)
+{
+    r->start_syscalls = bench_syscalls;
+    r->start_allocs = bench_allocs;
+    clock_gettime (CLOCK_MONOTONIC, &r->start);
+}
+
+static void run_stop (BenchRun *r)
+{
+    struct timespec end;
+
+    clock_gettime (CLOCK_MONOTONIC, &end);
+    r->time[r->count++] = (end.tv_sec - r->start.tv_sec) * 1000000000LL + end.tv_nsec - r->start.tv_nsec;
+    r->syscalls += bench_syscalls - r->start_syscalls;
+    r->allocs += bench_allocs - r->start_allocs;
+}
+
+static int compare_time (const void *a, const void *b)
+{
+    gint64 x = *(const gint64 *) a, y = *(const gint64 *) b;
+    return x < y ? -1 : x > y;
+}
+
+static void run_report (BenchRun *r, const char *stage, const char *backend, int sensors, int width, int height, const char *view)
+{
+    char sbuf[16], wbuf[16], hbuf[16];
+
+    qsort (r->time, r->count, sizeof (gint64), compare_time);
+    snprintf (sbuf, sizeof (sbuf), "%d", sensors);
+    snprintf (wbuf, sizeof (wbuf), "%d", width);
+    snprintf (hbuf, sizeof (hbuf), "%d", height);
+    printf ("%s\t%s\t%s\t%s\t%s\t%s\t%.2f\t%.2f\t%.2f\t%.2f\n", stage, backend ? backend : "-",
+        sensors ? sbuf : "-", width ? wbuf : "-", height ? hbuf : "-", view ? view : "-",
+        r->time[r->count / 2] / 1000.0, r->time[r->count * 99 / 100] / 1000.0,
+        (double) r->syscalls / r->count, (double) r->allocs / r->count);
+    fflush (stdout);
+    g_free (r->time);
+}
+
+/* Synthetic sensors */
+
+static char *bench_dir;
+
+static CPUTempSampler *bench_sampler (int numsensors, ReadBackend backend)
+{
+    CPUTempSampler *sm;
+    CPUTempSensor *s;
+    char *path, *name, *value;
+    int i;
+
+    path = g_build_filename (bench_dir, "throttled", NULL);
+    g_file_set_contents (path, "throttled=0x0\n", -1, NULL);
+    sm = sampler_new (NULL, path, backend);
+    g_free (path);
+
+    for (i = 0; i < numsensors; i++)
+    {
+        name = g_strdup_printf ("temp%d", i);
+        path = g_build_filename (bench_dir, name, NULL);
+        value = g_strdup_printf ("%d\n", 40000 + i * 500);
+        g_file_set_contents (path, value, -1, NULL);
+        s = sensor_new (SENSOR_THERMAL, name, path, NULL, sysfs_parse_temperature);
+        s->id = ++sm->next_id;
+        open_sensor (s);
+        g_ptr_array_add (sm->sensors, s);
+        sm->active++;
+        g_free (value);
+        g_free (name);
+    }
+    sm->generation++;
+
+    check_throttle (sm);
+    sampler_update_backend (sm);
+    if (sm->active_backend != backend)
+    {
+        sampler_free (sm);
+        return NULL;
+    }
+    return sm;
+}
+
+static void bench_sampling (int numsensors, ReadBackend backend)
+{
+    CPUTempSampler *sm;
+    CPUTempSample smp = { 0 };
+    BenchRun temp, throttle;
+    guint i;
+
+    if (!(sm = bench_sampler (numsensors, backend)))
+    {
+        printf ("# %s reads unavailable\n", backend_names[backend]);
+        return;
+    }
+
+    /* Warm up, so that one-off allocations aren't counted */
+    get_temperature (sm, &smp);
+    get_throttle (sm);
+
+    run_init (&temp);
+    run_init (&throttle);
+    for (i = 0; i < iterations; i++)
+    {
+        run_start (&temp);
+        get_temperature (sm, &smp);
+        run_stop (&temp);
+        run_start (&throttle);
+        get_throttle (sm);
+        run_stop (&throttle);
+    }
+    run_report (&temp, "get_temperature", backend_names[backend], numsensors, 0, 0, NULL);
+    run_report (&throttle, "get_throttle", backend_names[backend], numsensors, 0, 0, NULL);
+
+    g_free (smp.temperature);
+    sampler_free (sm);
+}
+
+/* Drawing */
+
+static const char *view_names[NUM_VIEWS] = { "bars", "lines", "heatmap" };
+
+static CPUTempPlugin *bench_plugin_new (CPUTempSampler *sm, int icon_size, SensorView view)
+{
+    CPUTempPlugin *c = g_new0 (CPUTempPlugin, 1);
+    int i;
+
+    gdk_rgba_parse (&c->foreground_color, "dark gray");
+    gdk_rgba_parse (&c->background_color, "light gray");
+    gdk_rgba_parse (&c->low_throttle_color, "orange");
+    gdk_rgba_parse (&c->high_throttle_color, "red");
+    gdk_rgba_parse (&c->freq_color, "blue");
+    c->show_freq = TRUE;
+    c->lower_temp = 40;
+    c->upper_temp = 90;
+    c->sensor_view = view;
+    c->sampler = sm;
+    c->client = sampler_subscribe (sm, c->sensor_policy, c->sensor_select, FALSE);
+    for (i = 0; i < NUM_TIERS; i++)
+    {
+        c->tiers[i].size = tier_spec[i].size;
+        c->tiers[i].period = tier_spec[i].period;
+        c->tiers[i].bucket = g_new0 (HistoryBucket, tier_spec[i].size);
+    }
+    c->time_offset = g_get_real_time () - g_get_monotonic_time ();
+
+    bench_plugin = c;
+    bench_icon_size = icon_size;
+    cpu_configuration_changed (NULL, NULL);
+    return c;
+}
+
+static void bench_plugin_free (CPUTempPlugin *c)
+{
+    int i;
+
+    sampler_unsubscribe (c->sampler, c->client);
+    cairo_surface_destroy (c->pixmap);
+    cairo_surface_destroy (c->graph);
+    cairo_surface_destroy (c->overlay);
+    glyphs_free (&c->glyphs);
+    ring_free (&c->ring);
+    stats_free (&c->stats);
+    g_free (c->raster);
+    g_free (c->sensor_stats);
+    g_free (c->temperature);
+    g_free (c->sensor_ids);
+    for (i = 0; i < NUM_TIERS; i++) g_free (c->tiers[i].bucket);
+    g_free (c);
+}
+
+/* Publish a sample with a temperature that varies from tick to tick, handing
+ * it out to the plugins just as the sampler thread does */
+static void bench_publish (CPUTempSampler *sm, guint tick)
+{
+    CPUTempSample *smp = &sm->current;
+    int i;
+
+    get_temperature (sm, smp);
+    smp->time = g_get_monotonic_time ();
+    smp->temp = 4500 + (tick % 30) * 100;
+    smp->throttle = (tick % 50 == 0) ? 0x2 : 0;
+    smp->freq = (tick % 50 < 5) ? 600 : 1500;
+    smp->freq_max = 1500;
+    for (i = 0; i < smp->numsensors; i++) smp->temperature[i] = smp->temp - (i % 5) * 100;
+    sampler_deliver (sm, smp);
+}
+
+/* Time taking in a sample, redrawing the whole graph and resizing it. Fails if
+ * taking in samples and redrawing leaves more heap memory in use than once
+ * the graph had been filled and drawn. */
+static gboolean bench_drawing (int numsensors, int icon_size, SensorView view)
+{
+    CPUTempSampler *sm = bench_sampler (numsensors, BACKEND_PREAD);
+    CPUTempPlugin *c = bench_plugin_new (sm, icon_size, view);
+    BenchRun update, redraw, resize;
+    guint i, width, height;
+    gint64 live;
+
+    /* Fill and draw the graph before timing */
+    for (i = 0; i < c->pixmap_width; i++)
+    {
+        bench_publish (sm, i);
+        cpu_update (c);
+    }
+    c->redraw_full = TRUE;
+    redraw_pixmap (c);
+
+    run_init (&update);
+    run_init (&redraw);
+    live = bench_live;
+    for (i = 0; i < iterations; i++)
+    {
+        bench_publish (sm, i);
+        run_start (&update);
+        cpu_update (c);
+        run_stop (&update);
+
+        c->redraw_full = TRUE;
+        run_start (&redraw);
+        redraw_pixmap (c);
+        run_stop (&redraw);
+    }
+    live = bench_live - live;
+    run_report (&update, "update", NULL, numsensors, c->pixmap_width, c->pixmap_height, view_names[view]);
+    run_report (&redraw, "redraw_pixmap", NULL, numsensors, c->pixmap_width, c->pixmap_height, view_names[view]);
+
+    /* Resize back and forth between this size and double it */
+    width = c->pixmap_width;
+    height = c->pixmap_height;
+    run_init (&resize);
+    for (i = 0; i < iterations; i++)
+    {
+        bench_icon_size = (i & 1) ? icon_size : icon_size * 2;
+        run_start (&resize);
+        cpu_configuration_changed (NULL, NULL);
+        run_stop (&resize);
+    }
+    run_report (&resize, "resize", NULL, numsensors, width, height, view_names[view]);
+
+    bench_plugin_free (c);
+    sampler_free (sm);
+    if (live > 0)
+    {
+        fprintf (stderr, "cputemp-bench: heap grew by %" G_GINT64_FORMAT " bytes over %u updates with %d sensors at %ux%u (%s)\n",
+            live, iterations, numsensors, width, height, view_names[view]);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+/* Draw a whole graph of bars as the plugin did before it had the rasteriser:
+ * the background filled, then a one-pixel stroke per column in its colour */
+static void raster_cairo (const BarRaster *br, cairo_surface_t *surface, int width)
+{
+    cairo_t *cr = cairo_create (surface);
+    guint32 col;
+    int x;
+
+    cairo_set_line_width (cr, 1.0);
+    cairo_set_source_rgb (cr, ((br->background >> 16) & 255) / 255.0, ((br->background >> 8) & 255) / 255.0, (br->background & 255) / 255.0);
+    cairo_rectangle (cr, 0, 0, width, br->height);
+    cairo_fill (cr);
+    for (x = 0; x < width; x++)
+    {
+        if (!br->temp[x]) continue;
+        col = br->color[x];
+        cairo_set_source_rgb (cr, ((col >> 16) & 255) / 255.0, ((col >> 8) & 255) / 255.0, (col & 255) / 255.0);
+        cairo_move_to (cr, x + 0.5, br->height);
+        cairo_line_to (cr, x + 0.5, br->height - (br->temp[x] - br->base) * (double) br->height / br->range);
+        cairo_stroke (cr);
+    }
+    cairo_destroy (cr);
+    cairo_surface_flush (surface);
+}
+
+/* Check that the vector and scalar rasteriser paths draw the same pixels for
+ * random bars, including empty ones and ones beyond the graph's range, and
+ * time each path, and the cairo strokes they replaced, drawing a whole graph. */
+static gboolean bench_raster (int icon_size)
+{
+    BarRaster br;
+    BenchRun runs[3];
+    cairo_surface_t *surface;
+    guint32 *pixels[2];
+    gint32 *space;
+    int height = icon_size - (BORDER_SIZE << 1), width = MAX ((height * 3) >> 1, 50);
+    int i, x, k, mismatches = 0;
+
+    memset (&br, 0, sizeof (br));
+    br.background = 0xd3d3d3;
+    for (i = 0; i < 16; i++) br.bar[i] = (i & 0x8) ? 0xff0000 : (i & 0x2) ? 0xffa500 : 0xa9a9a9;
+    br.height = height;
+    br.base = 4000;
+    br.range = 5000;
+    br.shift = 30 - 8 - g_bit_storage (br.height);
+    br.scale = (((gint64) br.height << (8 + br.shift)) + br.range - 1) / br.range;
+    space = g_new (gint32, RASTER_ARRAYS * width);
+    br.temp = space;
+    br.color = space + width;
+    br.full = space + 2 * width;
+    br.part = space + 3 * width;
+    br.blend = space + 4 * width;
+    pixels[0] = g_new (guint32, width * height);
+    pixels[1] = g_new (guint32, width * height);
+
+    for (i = 0; i < iterations; i++)
+    {
+        for (x = 0; x < width; x++)
+        {
+            br.temp[x] = g_random_int_range (0, 8) ? g_random_int_range (3000, 10000) : 0;
+            br.color[x] = br.bar[g_random_int_range (0, 16)];
+        }
+        /* Draw a random span of columns, so that unaligned starts and tails are covered */
+        k = g_random_int_range (0, width);
+        memset (pixels[0], 0, width * height * sizeof (guint32));
+        memset (pixels[1], 0, width * height * sizeof (guint32));
+        raster_bars (&br, pixels[0], width, k, width, FALSE);
+        raster_bars (&br, pixels[1], width, k, width, TRUE);
+        if (memcmp (pixels[0], pixels[1], width * height * sizeof (guint32))) mismatches++;
+    }
+    if (mismatches)
+    {
+        fprintf (stderr, "cputemp-bench: vector and scalar bars differ in %d of %u graphs at %dx%d\n", mismatches, iterations, width, height);
+        return FALSE;
+    }
+
+    for (k = 0; k < 2; k++)
+    {
+        run_init (&runs[k]);
+        for (i = 0; i < iterations; i++)
+        {
+            run_start (&runs[k]);
+            raster_bars (&br, pixels[k], width, 0, width, k);
+            run_stop (&runs[k]);
+        }
+    }
+    surface = cairo_image_surface_create (CAIRO_FORMAT_RGB24, width, height);
+    run_init (&runs[2]);
+    for (i = 0; i < iterations; i++)
+    {
+        run_start (&runs[2]);
+        raster_cairo (&br, surface, width);
+        run_stop (&runs[2]);
+    }
+    run_report (&runs[0], "raster_scalar", NULL, 0, width, height, NULL);
+    run_report (&runs[1], "raster_simd", NULL, 0, width, height, NULL);
+    run_report (&runs[2], "raster_cairo", NULL, 0, width, height, NULL);
+
+    cairo_surface_destroy (surface);
+    g_free (pixels[0]);
+    g_free (pixels[1]);
+    g_free (space);
+    return TRUE;
+}
+
+static void bench_log (const gchar *domain, GLogLevelFlags level, const gchar *message, gpointer data)
+{
+    if (level & (G_LOG_LEVEL_ERROR | G_LOG_LEVEL_CRITICAL | G_LOG_LEVEL_WARNING))
+        fprintf (stderr, "%s\n", message);
+}
+
+int main (int argc, char *argv[])
+{
+    GDir *dir;
+    const char *name;
+    char *path;
+    guint i, j, k;
+    int res = 0;
+
+    if (argc > 2 || (argc == 2 && !(iterations = strtoul (argv[1], NULL, 10))))
+    {
+        fprintf (stderr, "Usage: %s [iterations]\n", argv[0]);
+        return 1;
+    }
+
+    g_log_set_default_handler (bench_log, NULL);
+    printf ("# stage\tbackend\tsensors\twidth\theight\tview\tp50_us\tp99_us\tsyscalls\tallocs\n");
+
+    for (j = 0; j < G_N_ELEMENTS (bench_icon_sizes); j++)
+        if (!bench_raster (bench_icon_sizes[j])) return 1;
+
+    if (!(bench_dir = g_dir_make_tmp ("cputemp-bench-XXXXXX", NULL)))
+    {
+        fprintf (stderr, "cputemp-bench: cannot create sensor directory\n");
+        return 1;
+    }
+
+    for (i = 0; i < G_N_ELEMENTS (bench_sensors); i++)
+        for (j = 0; j < NUM_BACKENDS; j++)
+            bench_sampling (bench_sensors[i], j);
+
+    for (i = 0; i < G_N_ELEMENTS (bench_sensors); i++)
+        for (j = 0; j < G_N_ELEMENTS (bench_icon_sizes); j++)
+            for (k = 0; k < NUM_VIEWS; k++)
+                if (!bench_drawing (bench_sensors[i], bench_icon_sizes[j], k)) res = 1;
+
+    /* Remove the sensor files */
+    if ((dir = g_dir_open (bench_dir, 0, NULL)))
+    {
+        while ((name = g_dir_read_name (dir)))
+        {
+            path = g_build_filename (bench_dir, name, NULL);
+            g_unlink (path);
+            g_free (path);
+        }
+        g_dir_close (dir);
+    }
+    g_rmdir (bench_dir);
+    g_free (bench_dir);
+    return res;
+}
@@ -0,0 +1,104 @@
+/*
+ * Dump the saved history of the CPU temperature plugin
+ *
+ * Usage: lxplug-cputemp-dump [history file]
+ *
+ * Prints one line per record, oldest first, giving the local time of the
+ * sample, the highest sensor reading in degrees and the throttle status word.
+ */
+
+/*
+Copyright (c) 2018 Raspberry Pi (Trading) Ltd.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the
+      names of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "cputemp-history.h"
+
+int main (int argc, char *argv[])
+{
+    CPUTempHistoryHeader *hdr;
+    CPUTempHistoryRecord *rec;
+    char path[4096], tbuf[32];
+    const char *cache;
+    struct stat st;
+    struct tm tm;
+    time_t t;
+    uint32_t i;
+    int fd;
+
+    if (argc > 2)
+    {
+        fprintf (stderr, "Usage: %s [history file]\n", argv[0]);
+        return 1;
+    }
+
+    if (argc == 2) snprintf (path, sizeof (path), "%s", argv[1]);
+    else if ((cache = getenv ("XDG_CACHE_HOME")) && *cache)
+        snprintf (path, sizeof (path), "%s/lxpanel/%s", cache, CPUTEMP_HISTORY_FILE);
+    else
+        snprintf (path, sizeof (path), "%s/.cache/lxpanel/%s", getenv ("HOME") ? getenv ("HOME") : "", CPUTEMP_HISTORY_FILE);
+
+    if ((fd = open (path, O_RDONLY)) < 0 || fstat (fd, &st))
+    {
+        fprintf (stderr, "lxplug-cputemp-dump: cannot open %s - %s\n", path, strerror (errno));
+        return 1;
+    }
+
+    hdr = mmap (NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (hdr == MAP_FAILED)
+    {
+        fprintf (stderr, "lxplug-cputemp-dump: cannot map %s - %s\n", path, strerror (errno));
+        return 1;
+    }
+    if (!cputemp_history_valid (hdr, st.st_size))
+    {
+        fprintf (stderr, "lxplug-cputemp-dump: %s is not a CPU temperature history file\n", path);
+        return 1;
+    }
+
+    printf ("# time\ttemperature\tthrottle\n");
+    for (i = 0; i < hdr->count; i++)
+    {
+        rec = cputemp_history_record (hdr, i);
+        t = rec->time;
+        localtime_r (&t, &tm);
+        strftime (tbuf, sizeof (tbuf), "%Y-%m-%d %H:%M:%S", &tm);
+        printf ("%s.%03u\t%.2f\t0x%x\n", tbuf, rec->msec, rec->temp / 100.0, rec->throttle);
+    }
+
+    munmap (hdr, st.st_size);
+    close (fd);
+    return 0;
+}
@@ -0,0 +1,91 @@
+/*
+ * On-disk temperature history for the CPU temperature plugin
+ *
+ * The history file is a fixed-size ring of records following a header. The
+ * plugin maps it shared and stores each sample straight into the mapping;
+ * the header is updated after the record, so a crash can at worst lose the
+ * newest record.
+ */
+
+/*
+Copyright (c) 2018 Raspberry Pi (Trading) Ltd.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the
+      names of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef CPUTEMP_HISTORY_H
+#define CPUTEMP_HISTORY_H
+
+#include <stdint.h>
+#include <string.h>
+
+#define CPUTEMP_HISTORY_MAGIC       "CPUTEMPH"
+#define CPUTEMP_HISTORY_VERSION     1
+#define CPUTEMP_HISTORY_CAPACITY    65536       /* Records in file; a day at the fastest sample rate */
+#define CPUTEMP_HISTORY_FILE        "cputemp-history"   /* Name of file in user's cache directory */
+
+typedef struct
+{
+    char magic[8];                          /* CPUTEMP_HISTORY_MAGIC, not terminated */
+    uint32_t version;                       /* CPUTEMP_HISTORY_VERSION */
+    uint32_t record_size;                   /* Size of each record */
+    uint32_t capacity;                      /* Number of records in ring */
+    uint32_t head;                          /* Index of next record to be written */
+    uint32_t count;                         /* Number of records written, up to capacity */
+    uint32_t reserved[9];
+} CPUTempHistoryHeader;
+
+typedef struct
+{
+    uint32_t time;                          /* Time of sample, in seconds since the epoch */
+    uint16_t msec;                          /* Milliseconds part of time of sample */
+    int16_t temp;                           /* Combined sensor reading, in hundredths of a degree */
+    uint32_t throttle;                      /* Throttle status word */
+} CPUTempHistoryRecord;
+
+/* Size of a history file with the given capacity */
+static inline size_t cputemp_history_size (uint32_t capacity)
+{
+    return sizeof (CPUTempHistoryHeader) + (size_t) capacity * sizeof (CPUTempHistoryRecord);
+}
+
+/* Check that a mapped file of the given size holds a usable history */
+static inline int cputemp_history_valid (const CPUTempHistoryHeader *hdr, size_t size)
+{
+    if (size < sizeof (CPUTempHistoryHeader)) return 0;
+    if (memcmp (hdr->magic, CPUTEMP_HISTORY_MAGIC, sizeof (hdr->magic))) return 0;
+    if (hdr->version != CPUTEMP_HISTORY_VERSION) return 0;
+    if (hdr->record_size != sizeof (CPUTempHistoryRecord)) return 0;
+    if (size != cputemp_history_size (hdr->capacity)) return 0;
+    return hdr->head < hdr->capacity && hdr->count <= hdr->capacity;
+}
+
+/* The i'th oldest record held in a mapped history */
+static inline CPUTempHistoryRecord *cputemp_history_record (CPUTempHistoryHeader *hdr, uint32_t i)
+{
+    CPUTempHistoryRecord *rec = (CPUTempHistoryRecord *) (hdr + 1);
+    return &rec[(hdr->head + hdr->capacity - hdr->count + i) % hdr->capacity];
+}
+
+#endif
@@ -0,0 +1,203 @@
+/*
+ * Shared-memory sample publication for the CPU temperature plugin
+ *
+ * While it runs, the plugin publishes each sample it takes into a POSIX
+ * shared-memory segment, so that other local programs can follow the sensors
+ * without reading them again themselves. The segment is named by
+ * cputemp_shm_name and holds a header, a table of sensor labels and a ring of
+ * slots, each holding one sample.
+ *
+ * There is a single writer, so readers never block it. Each slot and the label
+ * table carry a sequence count which is odd while they are being written;
+ * a reader copies the data out between two reads of the count and tries again
+ * if the count was odd or changed. Each slot also records the number of the
+ * sample it holds, so that a reader can tell whether the sample it wanted has
+ * since been overwritten. Once mapped, reading takes no system calls.
+ *
+ * Every field shared between the processes is 32 bits wide, as 64-bit atomics
+ * are not lock-free on every target, and those that are not cannot be shared
+ * between processes. The sample count therefore wraps, after over a century
+ * at one sample a second; compare sample numbers by their difference.
+ *
+ * A reader gives up on a count that stays odd, which it only does if the
+ * writer died part way through; cputemp_shm_alive tells whether it did.
+ * The segment is removed when the plugin exits; a reader holding an old
+ * mapping sees the sample count stop advancing.
+ *
+ * This header is installed with the plugin, so that other programs can read
+ * the segment; lxplug-cputemp-watch is an example reader. As the layout may
+ * change between versions, a reader should check the version and sizes with
+ * cputemp_shm_valid before using a segment.
+ */
+
+/*
+Copyright (c) 2018 Raspberry Pi (Trading) Ltd.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the
+      names of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef CPUTEMP_SHM_H
+#define CPUTEMP_SHM_H
+
+#include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#define CPUTEMP_SHM_MAGIC           "CPUTEMPS"
+#define CPUTEMP_SHM_VERSION         2
+#define CPUTEMP_SHM_CAPACITY        256         /* Slots in ring; a power of two */
+#define CPUTEMP_SHM_SENSORS         32          /* Sensor readings held in each slot */
+#define CPUTEMP_SHM_LABEL           48          /* Space for each sensor label, including terminator */
+#define CPUTEMP_SHM_NONE            INT32_MIN   /* Reading of an empty sensor slot */
+#define CPUTEMP_SHM_SPINS           100000      /* Reads of a sequence count before giving up on the writer */
+
+typedef struct
+{
+    char magic[8];                          /* CPUTEMP_SHM_MAGIC, not terminated; written last */
+    uint32_t version;                       /* CPUTEMP_SHM_VERSION */
+    uint32_t header_size;                   /* Size of this header */
+    uint32_t slot_size;                     /* Size of each slot */
+    uint32_t capacity;                      /* Number of slots in ring */
+    uint32_t sensors;                       /* Number of readings in each slot and labels in table */
+    uint32_t pid;                           /* Process publishing the samples */
+    uint32_t count;                         /* Number of samples published, modulo 2^32; sample n is in slot n % capacity */
+    uint32_t label_seq;                     /* Sequence count of the label table */
+    uint32_t reserved[10];
+    char label[CPUTEMP_SHM_SENSORS][CPUTEMP_SHM_LABEL];     /* Label of each sensor slot; empty if unused */
+} CPUTempShmHeader;
+
+typedef struct
+{
+    uint32_t seq;                           /* Sequence count; odd while the slot is being written */
+    uint32_t throttle;                      /* Throttle status word */
+    uint32_t sample;                        /* Number of the sample held, modulo 2^32 */
+    uint32_t reserved;
+    int64_t time;                           /* Time of sample, in us since the epoch */
+    int32_t temp;                           /* Combined sensor reading, in hundredths of a degree */
+    uint32_t numsensors;                    /* Number of sensor slots in use */
+    int32_t temperature[CPUTEMP_SHM_SENSORS];   /* Reading of each sensor, in hundredths of a degree, or CPUTEMP_SHM_NONE */
+} CPUTempShmSlot;
+
+#define cputemp_shm_load(p)         __atomic_load_n (p, __ATOMIC_ACQUIRE)
+#define cputemp_shm_store(p, v)     __atomic_store_n (p, v, __ATOMIC_RELEASE)
+#define cputemp_shm_fence()         __atomic_thread_fence (__ATOMIC_ACQ_REL)
+
+_Static_assert (__atomic_always_lock_free (sizeof (uint32_t), 0), "shared counts need lock-free 32-bit atomics");
+
+/* Name of the segment published for the current user */
+static inline void cputemp_shm_name (char *buf, size_t len)
+{
+    snprintf (buf, len, "/lxpanel-cputemp-%u", (unsigned) getuid ());
+}
+
+/* Size of a segment with the given capacity */
+static inline size_t cputemp_shm_size (uint32_t capacity)
+{
+    return sizeof (CPUTempShmHeader) + (size_t) capacity * sizeof (CPUTempShmSlot);
+}
+
+/* Check that a mapped segment of the given size holds usable samples */
+static inline int cputemp_shm_valid (const CPUTempShmHeader *hdr, size_t size)
+{
+    if (size < sizeof (CPUTempShmHeader)) return 0;
+    if (memcmp (hdr->magic, CPUTEMP_SHM_MAGIC, sizeof (hdr->magic))) return 0;
+    if (hdr->version != CPUTEMP_SHM_VERSION) return 0;
+    if (hdr->header_size != sizeof (CPUTempShmHeader) || hdr->slot_size != sizeof (CPUTempShmSlot)) return 0;
+    if (hdr->sensors != CPUTEMP_SHM_SENSORS) return 0;
+    if (!hdr->capacity || (hdr->capacity & (hdr->capacity - 1))) return 0;
+    return size == cputemp_shm_size (hdr->capacity);
+}
+
+/* Check whether the process publishing to a segment is still running */
+static inline int cputemp_shm_alive (const CPUTempShmHeader *hdr)
+{
+    return !kill ((pid_t) hdr->pid, 0) || errno != ESRCH;
+}
+
+static inline CPUTempShmSlot *cputemp_shm_slot (CPUTempShmHeader *hdr, uint32_t n)
+{
+    CPUTempShmSlot *slot = (CPUTempShmSlot *) (hdr + 1);
+    return &slot[n & (hdr->capacity - 1)];
+}
+
+/* Read a sequence count until it is even, giving up after CPUTEMP_SHM_SPINS
+ * reads in all. Returns 0 if it gave up. */
+static inline int cputemp_shm_begin (const uint32_t *seqp, uint32_t *seq, unsigned *spins)
+{
+    while ((*seq = cputemp_shm_load (seqp)) & 1)
+        if (++*spins >= CPUTEMP_SHM_SPINS) return 0;
+    return 1;
+}
+
+/* Copy sample n into out. Returns 1 if it was copied, 0 if that sample has
+ * not been published yet or has been overwritten, and -1 if the slot stayed
+ * busy, as it does if the writer died while storing it. */
+static inline int cputemp_shm_read (CPUTempShmHeader *hdr, uint32_t n, CPUTempShmSlot *out)
+{
+    CPUTempShmSlot *slot = cputemp_shm_slot (hdr, n);
+    unsigned spins = 0;
+    uint32_t seq;
+
+    do
+    {
+        if (!cputemp_shm_begin (&slot->seq, &seq, &spins)) return -1;
+        memcpy (out, slot, sizeof (*out));
+        cputemp_shm_fence ();
+    } while (cputemp_shm_load (&slot->seq) != seq);
+    return out->sample == n && (int32_t) (cputemp_shm_load (&hdr->count) - n) > 0;
+}
+
+/* Copy the most recent sample into out. Returns 1 if it was copied, 0 if
+ * there is none yet, and -1 if its slot stayed busy. */
+static inline int cputemp_shm_latest (CPUTempShmHeader *hdr, CPUTempShmSlot *out)
+{
+    uint32_t count;
+    int res;
+
+    do
+    {
+        if (!(count = cputemp_shm_load (&hdr->count))) return 0;
+    } while (!(res = cputemp_shm_read (hdr, count - 1, out)));
+    return res;
+}
+
+/* Copy the label table into labels. Returns 0 if the table stayed busy. */
+static inline int cputemp_shm_labels (CPUTempShmHeader *hdr, char labels[CPUTEMP_SHM_SENSORS][CPUTEMP_SHM_LABEL])
+{
+    unsigned spins = 0;
+    uint32_t seq;
+
+    do
+    {
+        if (!cputemp_shm_begin (&hdr->label_seq, &seq, &spins)) return 0;
+        memcpy (labels, hdr->label, sizeof (hdr->label));
+        cputemp_shm_fence ();
+    } while (cputemp_shm_load (&hdr->label_seq) != seq);
+    return 1;
+}
+
+#endif
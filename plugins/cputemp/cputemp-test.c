@@ -0,0 +1,681 @@
+/*
+ * Unit tests for the CPU temperature plugin
+ *
+ * Usage: cputemp-test [GTest options]
+ *
+ * Like the benchmark, the plugin source is built into the tests, so that its
+ * internal functions can be called directly, without a panel or a display.
+ * Run them with 'make check'.
+ */
+
+/*
+Copyright (c) 2018 Raspberry Pi (Trading) Ltd.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the
+      names of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <glib/gstdio.h>
+#include <gtk/gtk.h>
+
+/* Nothing is shown, so the widget calls made while drawing are dropped */
+#define gtk_widget_queue_draw(w) ((void) (w))
+#define gtk_widget_set_size_request(w, x, y) ((void) (w))
+
+#include "cputemp.c"
+
+#define TEST_SENSORS    2               /* Sensors given to the plugin under test */
+#define TEST_NARROW     24              /* Icon size whose graph fits the smallest ring */
+#define TEST_WIDE       200             /* Icon size whose graph needs a larger ring */
+#define TEST_MAX_ICON   200             /* Largest icon size, that of the tallest panel */
+#define TEST_MARGIN     100             /* Readings tested beyond each end of the graph, in hundredths of a degree */
+#define TEST_SENTINEL   0xff00ff        /* Pixel left outside the columns drawn */
+
+/* Panel functions used by the plugin */
+
+static CPUTempPlugin *test_plugin;
+static gint test_icon_size;
+
+gpointer lxpanel_plugin_get_data (GtkWidget *plugin)
+{
+    return test_plugin;
+}
+
+void lxpanel_plugin_set_data (GtkWidget *plugin, gpointer data, GDestroyNotify destructor)
+{
+}
+
+gint panel_get_icon_size (LXPanel *panel)
+{
+    return test_icon_size;
+}
+
+gboolean config_setting_lookup_int (const config_setting_t *setting, const char *name, int *value)
+{
+    return FALSE;
+}
+
+gboolean config_setting_lookup_string (const config_setting_t *setting, const char *name, const char **value)
+{
+    return FALSE;
+}
+
+config_setting_t *config_group_set_int (config_setting_t *setting, const char *name, int value)
+{
+    return NULL;
+}
+
+config_setting_t *config_group_set_string (config_setting_t *setting, const char *name, const char *value)
+{
+    return NULL;
+}
+
+GtkWidget *lxpanel_generic_config_dlg (const char *title, LXPanel *panel, GSourceFunc apply_func, GtkWidget *plugin, const char *name, ...)
+{
+    return NULL;
+}
+
+/* Ring buffer */
+
+/* Entry n of a test ring holds values derived from n, so that any entry
+ * found in the wrong slot after a relayout is caught */
+static void ring_fill (SampleRing *r, guint count)
+{
+    gint64 n, end = r->head + count;
+
+    for (n = r->head; n < end; n++)
+        g_assert_cmpuint (ring_push (r, n, n & 0xFF, n + 1), ==, ring_slot (r, n));
+}
+
+static void ring_check (const SampleRing *r, guint count)
+{
+    gint64 n;
+    guint i;
+
+    g_assert_cmpint (r->head, >=, count);
+    for (n = r->head - count; n < r->head; n++)
+    {
+        i = ring_slot (r, n);
+        g_assert_cmpint (r->temp[i], ==, (gint16) n);
+        g_assert_cmpuint (r->flags[i], ==, n & 0xFF);
+        g_assert_cmpuint (r->freq[i], ==, (guint16) (n + 1));
+    }
+}
+
+/* Pushing past the capacity reuses the oldest slots, keeping the rest */
+static void test_ring_wrap (void)
+{
+    SampleRing r = { 0 };
+
+    g_assert_true (ring_reserve (&r, 50));
+    g_assert_cmpuint (r.capacity, ==, RING_MIN_CAPACITY);
+    ring_fill (&r, RING_MIN_CAPACITY - 1);
+    ring_check (&r, RING_MIN_CAPACITY - 1);
+    ring_fill (&r, 2);
+    ring_check (&r, RING_MIN_CAPACITY);
+    ring_fill (&r, 3 * RING_MIN_CAPACITY + 17);
+    ring_check (&r, RING_MIN_CAPACITY);
+    ring_free (&r);
+}
+
+/* Growing a ring whose head has passed its capacity keeps every entry held */
+static void test_ring_grow (void)
+{
+    SampleRing r = { 0 };
+
+    ring_reserve (&r, 50);
+    ring_fill (&r, RING_MIN_CAPACITY + 44);
+    g_assert_true (ring_reserve (&r, 2 * RING_MIN_CAPACITY + 1));
+    g_assert_cmpuint (r.capacity, ==, 4 * RING_MIN_CAPACITY);
+    ring_check (&r, RING_MIN_CAPACITY);
+
+    /* The entries moved are found again once the grown ring wraps */
+    ring_fill (&r, 3 * RING_MIN_CAPACITY);
+    ring_check (&r, 4 * RING_MIN_CAPACITY);
+    ring_fill (&r, 5 * RING_MIN_CAPACITY + 3);
+    ring_check (&r, 4 * RING_MIN_CAPACITY);
+    ring_free (&r);
+}
+
+/* A narrower graph keeps the ring as it is, and widening it again up to the
+ * capacity needs no relayout either */
+static void test_ring_shrink (void)
+{
+    SampleRing r = { 0 };
+    gint16 *temp;
+
+    ring_reserve (&r, 2 * RING_MIN_CAPACITY);
+    ring_fill (&r, 5 * RING_MIN_CAPACITY + 9);
+    temp = r.temp;
+    g_assert_false (ring_reserve (&r, 50));
+    g_assert_false (ring_reserve (&r, 2 * RING_MIN_CAPACITY));
+    g_assert_true (r.temp == temp);
+    g_assert_cmpuint (r.capacity, ==, 2 * RING_MIN_CAPACITY);
+    ring_check (&r, 2 * RING_MIN_CAPACITY);
+    ring_free (&r);
+}
+
+/* Plugin */
+
+static char *test_dir;
+
+static CPUTempSampler *test_sampler (void)
+{
+    CPUTempSampler *sm;
+    CPUTempSensor *s;
+    char *path, *name;
+    int i;
+
+    path = g_build_filename (test_dir, "throttled", NULL);
+    g_file_set_contents (path, "throttled=0x0\n", -1, NULL);
+    sm = sampler_new (NULL, path, BACKEND_PREAD);
+    g_free (path);
+
+    for (i = 0; i < TEST_SENSORS; i++)
+    {
+        name = g_strdup_printf ("temp%d", i);
+        path = g_build_filename (test_dir, name, NULL);
+        g_file_set_contents (path, "40000\n", -1, NULL);
+        s = sensor_new (SENSOR_THERMAL, name, path, NULL, sysfs_parse_temperature);
+        s->id = ++sm->next_id;
+        open_sensor (s);
+        g_ptr_array_add (sm->sensors, s);
+        sm->active++;
+        g_free (name);
+    }
+    sm->generation++;
+    return sm;
+}
+
+static CPUTempPlugin *test_plugin_new (CPUTempSampler *sm)
+{
+    CPUTempPlugin *c = g_new0 (CPUTempPlugin, 1);
+    int i;
+
+    gdk_rgba_parse (&c->foreground_color, "dark gray");
+    gdk_rgba_parse (&c->background_color, "light gray");
+    gdk_rgba_parse (&c->low_throttle_color, "orange");
+    gdk_rgba_parse (&c->high_throttle_color, "red");
+    gdk_rgba_parse (&c->freq_color, "blue");
+    c->lower_temp = 40;
+    c->upper_temp = 90;
+    c->sensor_view = VIEW_LINES;
+    c->sampler = sm;
+    c->client = sampler_subscribe (sm, c->sensor_policy, c->sensor_select, FALSE);
+    for (i = 0; i < NUM_TIERS; i++)
+    {
+        c->tiers[i].size = tier_spec[i].size;
+        c->tiers[i].period = tier_spec[i].period;
+        c->tiers[i].bucket = g_new0 (HistoryBucket, tier_spec[i].size);
+    }
+    c->time_offset = g_get_real_time () - g_get_monotonic_time ();
+
+    test_plugin = c;
+    test_icon_size = TEST_NARROW;
+    cpu_configuration_changed (NULL, NULL);
+    return c;
+}
+
+static void test_plugin_free (CPUTempPlugin *c)
+{
+    int i;
+
+    sampler_unsubscribe (c->sampler, c->client);
+    cairo_surface_destroy (c->pixmap);
+    cairo_surface_destroy (c->graph);
+    cairo_surface_destroy (c->overlay);
+    glyphs_free (&c->glyphs);
+    ring_free (&c->ring);
+    stats_free (&c->stats);
+    g_free (c->raster);
+    g_free (c->sensor_stats);
+    g_free (c->temperature);
+    g_free (c->sensor_ids);
+    for (i = 0; i < NUM_TIERS; i++) g_free (c->tiers[i].bucket);
+    g_free (c);
+}
+
+/* Reading of sensor i in sample n */
+static gint test_reading (int i, gint64 n)
+{
+    return 3000 + 1000 * i + n % 1000;
+}
+
+/* Hand the plugin samples one column apart, as the sampler thread would */
+static void test_feed (CPUTempSampler *sm, CPUTempPlugin *c, guint count)
+{
+    CPUTempSample *smp = &sm->current;
+    gint64 n, end = c->ring.head + count;
+    int i;
+
+    for (n = c->ring.head; n < end; n++)
+    {
+        get_temperature (sm, smp);
+        smp->time = (n + 1) * SAMPLE_INTERVAL * 1000;
+        smp->temp = test_reading (0, n);
+        smp->throttle = 0;
+        for (i = 0; i < smp->numsensors; i++) smp->temperature[i] = test_reading (i, n);
+        sampler_deliver (sm, smp);
+        cpu_update (c);
+        g_assert_cmpint (c->ring.head, ==, n + 1);
+    }
+}
+
+static void test_check (CPUTempPlugin *c, guint count)
+{
+    gint64 n;
+    guint slot;
+    int i;
+
+    g_assert_cmpint (c->numsensors, ==, TEST_SENSORS);
+    for (n = c->ring.head - count; n < c->ring.head; n++)
+    {
+        slot = ring_slot (&c->ring, n);
+        g_assert_cmpint (c->ring.temp[slot], ==, test_reading (TEST_SENSORS - 1, n));
+        for (i = 0; i < c->numsensors; i++)
+            g_assert_cmpint (c->sensor_stats[i * c->ring.capacity + slot], ==, test_reading (i, n));
+    }
+}
+
+/* Widening the graph past the ring's capacity, once the head has wrapped,
+ * relays the per-sensor readings along with the ring; narrowing it and
+ * widening it again leaves them where they are */
+static void test_sensor_stats_relayout (void)
+{
+    CPUTempSampler *sm = test_sampler ();
+    CPUTempPlugin *c = test_plugin_new (sm);
+    gint16 *sensor_stats;
+
+    g_assert_cmpuint (c->ring.capacity, ==, RING_MIN_CAPACITY);
+    test_feed (sm, c, RING_MIN_CAPACITY + 37);
+    test_check (c, RING_MIN_CAPACITY);
+
+    test_icon_size = TEST_WIDE;
+    cpu_configuration_changed (NULL, NULL);
+    g_assert_cmpuint (c->pixmap_width, >, RING_MIN_CAPACITY);
+    g_assert_cmpuint (c->ring.capacity, ==, 2 * RING_MIN_CAPACITY);
+    test_check (c, RING_MIN_CAPACITY);
+    test_feed (sm, c, 3 * RING_MIN_CAPACITY + 5);
+    test_check (c, 2 * RING_MIN_CAPACITY);
+
+    sensor_stats = c->sensor_stats;
+    test_icon_size = TEST_NARROW;
+    cpu_configuration_changed (NULL, NULL);
+    test_icon_size = TEST_WIDE;
+    cpu_configuration_changed (NULL, NULL);
+    g_assert_cmpuint (c->ring.capacity, ==, 2 * RING_MIN_CAPACITY);
+    g_assert_true (c->sensor_stats == sensor_stats);
+    test_check (c, 2 * RING_MIN_CAPACITY);
+
+    test_plugin_free (c);
+    sampler_free (sm);
+}
+
+/* Fitting the graph to the readings changes only the bounds it is drawn
+ * with, leaving the user's own to be saved and restored when it stops */
+static void test_autoscale (void)
+{
+    CPUTempSampler *sm = test_sampler ();
+    CPUTempPlugin *c = test_plugin_new (sm);
+
+    c->auto_scale = TRUE;
+    test_feed (sm, c, 100);
+    g_assert_cmpint (c->lower_temp, ==, 40);
+    g_assert_cmpint (c->upper_temp, ==, 90);
+    g_assert_cmpint (c->view_lower * 100, <=, test_reading (TEST_SENSORS - 1, 0));
+    g_assert_cmpint (c->view_upper * 100, >=, test_reading (TEST_SENSORS - 1, 99));
+    g_assert_cmpint (c->view_upper, <, c->upper_temp);
+
+    c->auto_scale = FALSE;
+    g_assert_true (autoscale (c));
+    g_assert_cmpint (c->view_lower, ==, 40);
+    g_assert_cmpint (c->view_upper, ==, 90);
+
+    test_plugin_free (c);
+    sampler_free (sm);
+}
+
+/* A selection matching no sensor leaves the graph empty, rather than
+ * showing readings of absolute zero */
+static void test_no_sensor (void)
+{
+    CPUTempSampler *sm = test_sampler ();
+    CPUTempPlugin *c = test_plugin_new (sm);
+    gint64 n;
+    gint min, max;
+    float mean;
+    int i;
+
+    c->auto_scale = TRUE;
+    sampler_set_policy (sm, c->client, POLICY_MEAN, "nosuch");
+    test_feed (sm, c, 20);
+    for (n = 0; n < 20; n++) g_assert_cmpint (c->ring.temp[ring_slot (&c->ring, n)], ==, 0);
+    g_assert_cmpint (c->stats.count, ==, 0);
+    for (i = 0; i < NUM_TIERS; i++) g_assert_null (history_bucket (&c->tiers[i], c->tiers[i].current));
+    g_assert_false (visible_stats (c, &min, &max, &mean));
+    g_assert_cmpint (label_value (c), ==, LABEL_NONE);
+    g_assert_cmpint (c->view_lower, ==, 40);
+    g_assert_cmpint (c->view_upper, ==, 90);
+
+    sampler_set_policy (sm, c->client, POLICY_MEAN, NULL);
+    test_feed (sm, c, 1);
+    g_assert_cmpint (c->stats.count, ==, 1);
+    g_assert_true (visible_stats (c, &min, &max, &mean));
+    g_assert_cmpint (min, ==, whole_degrees ((test_reading (0, 20) + test_reading (1, 20) + 1) / 2));
+
+    test_plugin_free (c);
+    sampler_free (sm);
+}
+
+/* Traces */
+
+/* Readings below zero and missing readings are replayed as they were recorded */
+static void test_trace_round_trip (void)
+{
+    static const gint readings[][3] = { { -500, SENSOR_NONE, 4250 }, { SENSOR_NONE, -1, -12345 } };
+    CPUTempSampler *sm = test_sampler ();
+    CPUTempPlugin *c = test_plugin_new (sm);
+    CPUTempSample in = { 0 }, out = { 0 };
+    char *path, line[256];
+    guint n = 0;
+    int i;
+
+    path = g_build_filename (test_dir, "trace", NULL);
+    c->record = fopen (path, "w+");
+    g_assert_nonnull (c->record);
+    in.numsensors = 3;
+    for (n = 0; n < G_N_ELEMENTS (readings); n++)
+    {
+        in.time = (n + 1) * SAMPLE_INTERVAL * 1000;
+        in.throttle = n;
+        in.temp = -100 * (gint) n - 1;
+        in.temperature = (gint *) readings[n];
+        record_sample (c, &in);
+    }
+
+    rewind (c->record);
+    sm->replay = g_new0 (TraceReplay, 1);
+    n = 0;
+    while (fgets (line, sizeof (line), c->record))
+    {
+        if (line[0] == '#') continue;
+        g_assert_cmpuint (n, <, G_N_ELEMENTS (readings));
+        g_assert_true (replay_parse (sm, line, &out));
+        g_assert_cmpint (out.time, ==, n * SAMPLE_INTERVAL * 1000);
+        g_assert_cmpuint (out.throttle, ==, n);
+        g_assert_cmpint (out.temp, ==, -100 * (gint) n - 1);
+        g_assert_cmpuint (out.numsensors, ==, 3);
+        for (i = 0; i < 3; i++) g_assert_cmpint (out.temperature[i], ==, readings[n][i]);
+        n++;
+    }
+    g_assert_cmpuint (n, ==, G_N_ELEMENTS (readings));
+
+    g_free (sm->replay);
+    sm->replay = NULL;
+    fclose (c->record);
+    c->record = NULL;
+    g_unlink (path);
+    g_free (path);
+    g_free (out.temperature);
+    test_plugin_free (c);
+    sampler_free (sm);
+}
+
+/* Per-instance policies */
+
+/* Combined reading the sampler last gave an instance */
+static gint test_delivered (SampleClient *cl)
+{
+    CPUTempSample *smp;
+    gint temp;
+
+    smp = queue_peek (&cl->queue);
+    g_assert_nonnull (smp);
+    temp = smp->temp;
+    queue_pop (&cl->queue);
+    return temp;
+}
+
+/* Overwrite sensor i's file in place, as the sampler keeps it open */
+static void test_write_sensor (int i, const char *contents)
+{
+    char *name, *path;
+    FILE *fp;
+
+    name = g_strdup_printf ("temp%d", i);
+    path = g_build_filename (test_dir, name, NULL);
+    fp = fopen (path, "w");
+    g_assert_nonnull (fp);
+    fputs (contents, fp);
+    fclose (fp);
+    g_free (path);
+    g_free (name);
+}
+
+/* Hand every instance sample n */
+static void test_deliver (CPUTempSampler *sm, gint64 n)
+{
+    CPUTempSample *smp = &sm->current;
+    int i;
+
+    get_temperature (sm, smp);
+    for (i = 0; i < smp->numsensors; i++) smp->temperature[i] = test_reading (i, n);
+    sampler_deliver (sm, smp);
+}
+
+/* Each instance gets the readings combined by its own policy, and the sampler
+ * reads every sensor that any instance needs, for as long as it needs it */
+static void test_client_policy (void)
+{
+    CPUTempSampler *sm = test_sampler ();
+    SampleClient *a, *b;
+    CPUTempSensor *s0 = g_ptr_array_index (sm->sensors, 0);
+    CPUTempSensor *s1 = g_ptr_array_index (sm->sensors, 1);
+
+    a = sampler_subscribe (sm, POLICY_PRIMARY, "temp1, temp0", FALSE);
+    g_assert_cmpint (s0->role, ==, ROLE_SECONDARY);
+    g_assert_cmpint (s1->role, ==, ROLE_NEEDED);
+
+    b = sampler_subscribe (sm, POLICY_MEAN, "temp0", FALSE);
+    g_assert_cmpint (s0->role, ==, ROLE_NEEDED);
+    g_assert_cmpint (s1->role, ==, ROLE_NEEDED);
+    test_deliver (sm, 1);
+    g_assert_cmpint (test_delivered (a), ==, test_reading (1, 1));
+    g_assert_cmpint (test_delivered (b), ==, test_reading (0, 1));
+
+    sampler_set_policy (sm, b, POLICY_MEAN, NULL);
+    test_deliver (sm, 2);
+    g_assert_cmpint (test_delivered (a), ==, test_reading (1, 2));
+    g_assert_cmpint (test_delivered (b), ==, (test_reading (0, 2) + test_reading (1, 2) + 1) / 2);
+
+    /* A sensor which can't be read is left out, rather than read as -0.01 */
+    test_write_sensor (0, "garbage\n");
+    test_write_sensor (1, "45000\n");
+    g_assert_cmpint (get_temperature (sm, &sm->current), ==, 4500);
+    g_assert_cmpint (sm->current.temperature[0], ==, SENSOR_NONE);
+    sampler_deliver (sm, &sm->current);
+    g_assert_cmpint (test_delivered (a), ==, 4500);
+    g_assert_cmpint (test_delivered (b), ==, 4500);
+    test_write_sensor (0, "40000\n");
+
+    sampler_unsubscribe (sm, b);
+    g_assert_cmpint (s0->role, ==, ROLE_SECONDARY);
+    g_assert_cmpint (s1->role, ==, ROLE_NEEDED);
+
+    sampler_set_policy (sm, a, POLICY_MAX, "temp0");
+    g_assert_cmpint (s0->role, ==, ROLE_NEEDED);
+    g_assert_cmpint (s1->role, ==, ROLE_UNUSED);
+    test_deliver (sm, 3);
+    g_assert_cmpint (test_delivered (a), ==, test_reading (0, 3));
+
+    sampler_unsubscribe (sm, a);
+    sampler_free (sm);
+}
+
+/* Bar rasteriser */
+
+/* Top of the bar for a reading, in 256ths of a row from the top of the graph:
+ * the height of the reading above the bottom bound, scaled to the graph by the
+ * rasteriser's fixed-point factor, and clipped to the graph. */
+static gint64 bar_top (const BarRaster *br, gint32 temp)
+{
+    gint64 d;
+
+    if (!temp) return (gint64) br->height << 8;
+    d = CLAMP (temp - br->base, 0, br->range);
+    return MAX (((gint64) br->height << 8) - ((d * br->scale) >> br->shift), 0);
+}
+
+/* Reference for one pixel of a bar: the background blended towards the bar
+ * colour by the part of the pixel below the bar's top, in 256ths, rounding
+ * each channel to the nearest level. Unlike the rasteriser, each pixel is
+ * worked out on its own from the reading, in 64-bit arithmetic. */
+static guint32 bar_reference (const BarRaster *br, gint32 temp, guint32 color, int row)
+{
+    gint64 cov = CLAMP (((gint64) row + 1) * 256 - bar_top (br, temp), 0, 256);
+    guint32 pixel = 0;
+    gint64 b, f;
+    int ch;
+
+    for (ch = 0; ch <= 16; ch += 8)
+    {
+        b = (br->background >> ch) & 255;
+        f = (color >> ch) & 255;
+        pixel |= (guint32) (b + (((f - b) * cov + 128) >> 8)) << ch;
+    }
+    return pixel;
+}
+
+/* At every panel size, for readings a few hundredths of a degree apart from
+ * below the graph to above it, both rasteriser paths draw exactly the
+ * reference pixels, and no others.
+ * The reference's bar tops are in turn within 1/256 of a row of those the
+ * plugin's cairo drawing used, from temp_to_y. */
+static void test_raster_reference (void)
+{
+    static const int bounds[][2] = { { 40, 90 }, { 0, 100 }, { 45, 46 } };
+    CPUTempPlugin c = { 0 };
+    BarRaster br;
+    gint32 *space;
+    guint32 *pixels, want;
+    double y;
+    int b, icon, simd, step, count, width, x, row;
+
+    gdk_rgba_parse (&c.foreground_color, "dark gray");
+    gdk_rgba_parse (&c.background_color, "light gray");
+    gdk_rgba_parse (&c.low_throttle_color, "orange");
+    gdk_rgba_parse (&c.high_throttle_color, "red");
+
+    for (b = 0; b < G_N_ELEMENTS (bounds); b++)
+    {
+        c.view_lower = bounds[b][0];
+        c.view_upper = bounds[b][1];
+
+        /* A column for each reading, with one either side left undrawn, and
+         * one with no reading. The step is coprime to 256, so that wide
+         * graphs still see bar tops at many fractions of a row. */
+        step = ((c.view_upper - c.view_lower) / 10) | 1;
+        count = ((c.view_upper - c.view_lower) * 100 + 2 * TEST_MARGIN) / step + 1;
+        width = count + 3;
+        space = g_new (gint32, RASTER_ARRAYS * width);
+        pixels = g_new (guint32, width * (TEST_MAX_ICON - (BORDER_SIZE << 1)));
+
+        for (icon = (BORDER_SIZE << 1) + 1; icon <= TEST_MAX_ICON; icon++)
+        {
+            c.pixmap_height = icon - (BORDER_SIZE << 1);
+            raster_setup (&c, &br, space, width);
+            for (x = 0; x < width; x++)
+            {
+                br.temp[x] = x == width - 2 ? 0 : c.view_lower * 100 - TEST_MARGIN + (x - 1) * step;
+                br.color[x] = br.bar[x & 0xF];
+            }
+
+            for (x = 1; x < width - 2; x++)
+            {
+                y = temp_to_y (&c, CLAMP (br.temp[x], br.base, br.base + br.range) / 100.0);
+                g_assert_cmpfloat (ABS (bar_top (&br, br.temp[x]) / 256.0 - y), <=, 1.0 / 256 + 1e-3);
+            }
+
+            for (simd = 0; simd < 2; simd++)
+            {
+                for (x = 0; x < width * c.pixmap_height; x++) pixels[x] = TEST_SENTINEL;
+                raster_bars (&br, pixels, width, 1, width - 1, simd);
+                for (row = 0; row < c.pixmap_height; row++)
+                {
+                    for (x = 0; x < width; x++)
+                    {
+                        want = x && x < width - 1 ? bar_reference (&br, br.temp[x], br.color[x], row) : TEST_SENTINEL;
+                        if (pixels[row * width + x] != want)
+                            g_error ("%s bar for %d at icon size %d, bounds %d to %d: row %d is %06x, not %06x",
+                                simd ? "vector" : "scalar", br.temp[x], icon, c.view_lower, c.view_upper,
+                                row, pixels[row * width + x], want);
+                    }
+                }
+            }
+        }
+
+        g_free (pixels);
+        g_free (space);
+    }
+}
+
+int main (int argc, char *argv[])
+{
+    GDir *dir;
+    const char *name;
+    char *path;
+    int res;
+
+    g_test_init (&argc, &argv, NULL);
+    if (!(test_dir = g_dir_make_tmp ("cputemp-test-XXXXXX", NULL)))
+    {
+        fprintf (stderr, "cputemp-test: cannot create sensor directory\n");
+        return 1;
+    }
+
+    g_test_add_func ("/ring/wrap", test_ring_wrap);
+    g_test_add_func ("/ring/grow", test_ring_grow);
+    g_test_add_func ("/ring/shrink", test_ring_shrink);
+    g_test_add_func ("/ring/sensor-stats-relayout", test_sensor_stats_relayout);
+    g_test_add_func ("/plugin/autoscale", test_autoscale);
+    g_test_add_func ("/sampler/client-policy", test_client_policy);
+    g_test_add_func ("/plugin/no-sensor", test_no_sensor);
+    g_test_add_func ("/trace/round-trip", test_trace_round_trip);
+    g_test_add_func ("/raster/reference", test_raster_reference);
+    res = g_test_run ();
+
+    /* Remove the sensor files */
+    if ((dir = g_dir_open (test_dir, 0, NULL)))
+    {
+        while ((name = g_dir_read_name (dir)))
+        {
+            path = g_build_filename (test_dir, name, NULL);
+            g_unlink (path);
+            g_free (path);
+        }
+        g_dir_close (dir);
+    }
+    g_rmdir (test_dir);
+    g_free (test_dir);
+    return res;
+}
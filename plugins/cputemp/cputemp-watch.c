@@ -0,0 +1,167 @@
+/*
+ * Follow the samples published by the CPU temperature plugin
+ *
+ * Usage: lxplug-cputemp-watch [-f] [number of samples]
+ *
+ * Prints the sensor labels and the most recent samples, oldest first, from
+ * the plugin's shared-memory segment; with -f, carries on printing samples
+ * as they are published. This is also an example of reading the segment: see
+ * cputemp-shm.h.
+ */
+
+/*
+Copyright (c) 2018 Raspberry Pi (Trading) Ltd.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the
+      names of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "cputemp-shm.h"
+
+#define POLL_INTERVAL   250             /* Time between checks for new samples when following, in ms */
+
+static void print_sample (const CPUTempShmSlot *slot)
+{
+    char tbuf[32];
+    struct tm tm;
+    time_t t = slot->time / 1000000;
+    uint32_t i;
+
+    localtime_r (&t, &tm);
+    strftime (tbuf, sizeof (tbuf), "%Y-%m-%d %H:%M:%S", &tm);
+    printf ("%s.%03u\t%.2f\t0x%x", tbuf, (unsigned) (slot->time / 1000 % 1000), slot->temp / 100.0, slot->throttle);
+    for (i = 0; i < slot->numsensors; i++)
+    {
+        if (slot->temperature[i] == CPUTEMP_SHM_NONE) printf ("\t-");
+        else printf ("\t%.2f", slot->temperature[i] / 100.0);
+    }
+    printf ("\n");
+}
+
+int main (int argc, char *argv[])
+{
+    CPUTempShmHeader *hdr;
+    CPUTempShmSlot slot;
+    char name[64], labels[CPUTEMP_SHM_SENSORS][CPUTEMP_SHM_LABEL];
+    struct timespec poll = { 0, POLL_INTERVAL * 1000000L };
+    struct stat st;
+    uint32_t n, count;
+    char *end;
+    long samples = 10;
+    int fd, i, res = 0, follow = 0;
+
+    if (argc > 1 && !strcmp (argv[1], "-f"))
+    {
+        follow = 1;
+        argc--;
+        argv++;
+    }
+    if (argc == 2)
+    {
+        errno = 0;
+        samples = strtol (argv[1], &end, 10);
+        if (end == argv[1] || *end || errno) samples = 0;
+    }
+    if (argc > 2 || samples <= 0)
+    {
+        fprintf (stderr, "Usage: lxplug-cputemp-watch [-f] [number of samples]\n");
+        return 1;
+    }
+
+    cputemp_shm_name (name, sizeof (name));
+    if ((fd = shm_open (name, O_RDONLY, 0)) < 0 || fstat (fd, &st))
+    {
+        fprintf (stderr, "lxplug-cputemp-watch: cannot open shared memory %s - %s\n", name, strerror (errno));
+        return 1;
+    }
+    hdr = mmap (NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close (fd);
+    if (hdr == MAP_FAILED)
+    {
+        fprintf (stderr, "lxplug-cputemp-watch: cannot map shared memory %s - %s\n", name, strerror (errno));
+        return 1;
+    }
+    if (!cputemp_shm_valid (hdr, st.st_size))
+    {
+        fprintf (stderr, "lxplug-cputemp-watch: %s does not hold CPU temperature samples\n", name);
+        return 1;
+    }
+
+    /* From here on, reading the segment needs no system calls, except to
+     * check on the plugin when the segment stops changing */
+    if (!cputemp_shm_labels (hdr, labels))
+    {
+        fprintf (stderr, "lxplug-cputemp-watch: sensor labels in %s are not being updated\n", name);
+        return 1;
+    }
+    printf ("# time\ttemperature\tthrottle");
+    for (i = 0; i < CPUTEMP_SHM_SENSORS; i++)
+        if (labels[i][0]) printf ("\t%d: %s", i, labels[i]);
+    printf ("\n");
+
+    count = cputemp_shm_load (&hdr->count);
+    if ((unsigned long) samples > hdr->capacity) samples = (long) hdr->capacity;
+    n = count - (uint32_t) samples;
+    while (1)
+    {
+        for (; n != count; n++)
+        {
+            if ((res = cputemp_shm_read (hdr, n, &slot)) > 0) print_sample (&slot);
+            else if (res < 0) break;
+        }
+        if (!follow) break;
+        fflush (stdout);
+
+        while ((count = cputemp_shm_load (&hdr->count)) == n)
+        {
+            if (!cputemp_shm_alive (hdr)) break;
+            nanosleep (&poll, NULL);
+        }
+        if (count == n || res < 0)
+        {
+            if (!cputemp_shm_alive (hdr))
+            {
+                fprintf (stderr, "lxplug-cputemp-watch: the plugin publishing to %s has exited\n", name);
+                break;
+            }
+            nanosleep (&poll, NULL);
+            continue;
+        }
+
+        /* If the reader has fallen more than a ring behind, skip the lost samples */
+        if (count - n > hdr->capacity) n = count - hdr->capacity;
+    }
+
+    munmap (hdr, st.st_size);
+    return 0;
+}
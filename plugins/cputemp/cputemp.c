@@ -37,17 +37,33 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include <config.h>
 #endif
 #include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/file.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/time.h>
 #include <time.h>
 #include <sys/sysinfo.h>
 #include <stdlib.h>
 #include <glib/gi18n.h>
+#include <glib-unix.h>
+#include <signal.h>
+
+#ifdef HAVE_LINUX_IO_URING_H
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
 
 #include "plugin.h"
 
-#define BORDER_SIZE 2
+#include "cputemp-history.h"
+#include "cputemp-shm.h"
 
-#define MAX_NUM_SENSORS             10
+#define BORDER_SIZE 2
 
 #define PROC_THERMAL_DIRECTORY      "/proc/acpi/thermal_zone/"
 #define PROC_THERMAL_TEMPF          "temperature"
@@ -56,9 +72,512 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #define SYSFS_THERMAL_DIRECTORY     "/sys/class/thermal/"
 #define SYSFS_THERMAL_SUBDIR_PREFIX "thermal_zone"
 #define SYSFS_THERMAL_TEMPF         "temp"
+#define SYSFS_THERMAL_TYPEF         "type"
+
+#define SYSFS_HWMON_DIRECTORY       "/sys/class/hwmon/"
+
+#define SYSFS_CPUFREQ_DIRECTORY     "/sys/devices/system/cpu/cpufreq/"
+#define SYSFS_CPUFREQ_PREFIX        "policy"
+#define SYSFS_CPUFREQ_CUR           "scaling_cur_freq"
+#define SYSFS_CPUFREQ_MAX           "cpuinfo_max_freq"
+
+#define SYSFS_THROTTLE_FILE         "/sys/devices/platform/soc/soc:firmware/get_throttled"
+
+#define VCIO_DEVICE                 "/dev/vcio"
+#define VCIO_IOC_MAGIC              100
+#define IOCTL_MBOX_PROPERTY         _IOWR(VCIO_IOC_MAGIC, 0, char *)
+#define MBOX_TAG_GET_THROTTLED      0x00030046
+#define MBOX_RESPONSE_SUCCESS       0x80000000
+
+#define VCGENCMD_INTERVAL           10000000    /* Minimum time between vcgencmd calls, in us */
+
+#define SAMPLE_INTERVAL             1500        /* Time between samples when active, and time covered by one graph column, in ms */
+#define SAMPLE_INTERVAL_IDLE        5000        /* Time between samples when readings are stable, in ms */
+#define SAMPLE_INTERVAL_SLOW        10000       /* Time between samples when readings have been stable for longer, in ms */
+#define SAMPLE_INTERVAL_HIDDEN      60000       /* Time between samples while the graph can't be seen, in ms */
+#define SAMPLE_STABLE_COUNT         10          /* Stable samples before slowing down to the next interval */
+#define SAMPLE_ACTIVE_DELTA         200         /* Change in temperature between samples which counts as activity, in hundredths of a degree */
+#define THROTTLE_CURRENT            0xF         /* Throttle status bits showing current (not sticky) conditions */
+#define SAMPLE_QUEUE_SIZE           16          /* Samples held between sampler and main thread; must be a power of two */
+#define SENSOR_TIMEOUT              250000      /* Reads slower than this put the sensor into backoff, in us */
+#define SENSOR_MAX_BACKOFF          64          /* Maximum number of samples for which a slow sensor is skipped */
+#define SENSOR_SECONDARY_RATE       8           /* Samples per read of a sensor not needed by the aggregation policy */
+#define URING_ENTRIES               32          /* Reads submitted together in one batch */
+#define SENSOR_RESCAN_INTERVAL      60          /* Time between checks for added or removed sensors, in s */
+#define RING_MIN_CAPACITY           256         /* Smallest graph ring; wider than the graph at usual panel sizes */
+#define SENSOR_BUFSIZE              256         /* Largest sensor file contents read */
+#define TRACE_MAGIC                 "# cputemp trace 1"
+#define TRACE_SENSOR                "# sensor "
+#define TRACE_RETRY                 10          /* Time to wait for space in the queue when replaying, in ms */
+#define TRACE_MAX_SENSORS           1024        /* Most sensor slots accepted from a trace */
+#define REPLAY_MAX_SPEED            1000        /* Fastest replay, as a multiple of real time */
+#define HIST_BUCKETS                24          /* Power-of-two ranges in a histogram, up to about 8 s */
+#define METRICS_INTERVAL            15          /* Default least time between metrics file writes, in s */
+#define STATS_FILE                  "cputemp-stats"     /* Name of statistics dump in user's cache directory */
+#define STATS_EWMA_WEIGHT           0.1         /* Weight of each new entry in the smoothed reading and rate */
+#define AUTOSCALE_STEP              5           /* Auto-scaled bounds are multiples of this, in degrees */
+#define AUTOSCALE_MARGIN            2           /* Least space kept between readings and auto-scaled bounds, in degrees */
+#define AUTOSCALE_MIN_SPAN          20          /* Least range of an auto-scaled graph, in degrees */
+#define SENSOR_NONE                 G_MININT    /* Reading given for an empty sensor slot */
+#define COMBINED_NONE               -27300      /* Combined reading when no sensor was combined; absolute zero */
+
+/* Histogram of times, in power-of-two ranges of microseconds. Bucket b
+ * counts times of at least 2^(b-1) and less than 2^b us; bucket 0 counts
+ * times under 1 us. */
+
+typedef struct
+{
+    guint count[HIST_BUCKETS];              /* Times in each range */
+    guint n;                                /* Number of times */
+    guint64 total;                          /* Sum of times, in us */
+    guint64 max;                            /* Longest time, in us */
+} Histogram;
+
+typedef struct _CPUTempSensor CPUTempSensor;
+
+typedef gint (*ParseTempFunc) (const char *buf);
+
+typedef enum
+{
+    SENSOR_PROC,                            /* ACPI thermal zone in procfs */
+    SENSOR_THERMAL,                         /* Thermal zone in sysfs */
+    SENSOR_HWMON,                           /* Temperature input of a hwmon device */
+    SENSOR_TRACE,                           /* Sensor in a trace being replayed */
+    SENSOR_CPUFREQ                          /* Current frequency of a cpufreq policy, in place of a temperature */
+} SensorType;
+
+/* How the readings of the selected sensors are combined into the one shown */
+
+typedef enum
+{
+    POLICY_MAX,                             /* Highest reading */
+    POLICY_MEAN,                            /* Mean of readings */
+    POLICY_WEIGHTED,                        /* Mean of readings, weighted as given in the selection */
+    POLICY_PRIMARY,                         /* Reading of the first selected sensor */
+    NUM_POLICIES
+} SensorPolicy;
+
+/* How a sensor is used by the policy, which decides how often it is read */
+
+typedef enum
+{
+    ROLE_NEEDED,                            /* Combined into the reading shown; read every sample */
+    ROLE_SECONDARY,                         /* Selected, but only shown on its own; read every SENSOR_SECONDARY_RATE samples */
+    ROLE_UNUSED                             /* Not selected; never read */
+} SensorRole;
+
+/* A sensor file, opened once and re-read in place on every update */
+
+struct _CPUTempSensor
+{
+    guint id;                               /* Unique for the life of the sampler; never reused */
+    SensorType type;                        /* Where the sensor was found */
+    char *name;                             /* Name of the sensor in its source, e.g. thermal_zone0 or hwmon1/temp2 */
+    char *path;                             /* Full path of the file holding the reading */
+    char *label;                            /* Name shown to the user */
+    int fd;                                 /* Persistent descriptor, or -1 if not open */
+    ParseTempFunc parse;                    /* Parser for the file contents */
+    char buf[SENSOR_BUFSIZE];               /* Contents of the file at the last read */
+    guint index;                            /* Entry in the io_uring file table */
+    Histogram read_time;                    /* Time taken by synchronous reads */
+    gboolean batched;                       /* Value has been read in this sample's batch */
+    gint value;                             /* Last reading, in hundredths of a degree */
+    guint backoff;                          /* Samples to skip after the next slow read */
+    guint skip;                             /* Samples left to skip before reading again */
+    SensorRole role;                        /* Most use made of the sensor by any instance's policy */
+};
+
+/* Throttle status sources, in order of preference. Each provider is probed
+ * once at start-up; the first one which opens successfully is used. */
+
+typedef struct _ThrottleSource ThrottleSource;
+
+typedef struct
+{
+    const char *name;
+    gboolean (*open) (ThrottleSource *t);
+    gboolean (*read) (ThrottleSource *t, guint *val);
+} ThrottleProvider;
+
+struct _ThrottleSource
+{
+    const ThrottleProvider *provider;       /* Active provider, or NULL if none */
+    CPUTempSensor file;                     /* Persistent file for file-backed providers */
+    guint value;                            /* Last value read, for rate-limited providers */
+    gint64 stamp;                           /* Time of last read, for rate-limited providers */
+    gint batched;                           /* Value read in this sample's batch: 1 if valid, -1 if not, else 0 */
+    const char *root;                       /* Prefix for sysfs paths */
+};
+
+/* A set of readings taken together by the sampler */
+
+typedef struct
+{
+    gint64 time;                            /* Monotonic time of the sample, in us */
+    gint temp;                              /* Sensor readings combined by the aggregation policy, in hundredths of a degree */
+    guint throttle;                         /* Throttle status word */
+    guint freq;                             /* Highest current CPU frequency, in MHz; 0 if unknown */
+    guint freq_max;                         /* Highest possible CPU frequency, in MHz; 0 if unknown */
+    guint generation;                       /* Sensor registry generation when the sample was taken */
+    gint numsensors;                        /* Number of sensor slots */
+    gint *temperature;                      /* Reading from each sensor slot, in hundredths of a degree, or SENSOR_NONE */
+    gint size;                              /* Number of readings allocated */
+} CPUTempSample;
+
+/* Lock-free single-producer, single-consumer queue of samples. Only the
+ * sampler thread writes head and only the main thread writes tail. Samples
+ * are filled and read in place; a slot's readings are only reallocated by
+ * the sampler while the slot is free, so neither side needs a lock. */
+
+typedef struct
+{
+    CPUTempSample slot[SAMPLE_QUEUE_SIZE];
+    gint head;                              /* Count of samples pushed */
+    gint tail;                              /* Count of samples popped */
+} SampleQueue;
+
+/* A plugin instance taking samples from the shared sampler. Each has its own
+ * queue, so an instance which falls behind only drops its own samples, and
+ * its own policy, by which the sampler combines the readings it is given.
+ * The policy, selection, roles and weights are changed with the lock held. */
+
+typedef struct
+{
+    SampleQueue queue;                      /* Samples waiting for the instance */
+    int event_fd;                           /* Signalled when samples are pushed */
+    gboolean hidden;                        /* Whether the instance's graph can't be seen */
+    gboolean save_history;                  /* Whether the instance wants samples saved to the history file */
+    SensorPolicy policy;                    /* How the instance combines sensor readings */
+    char *selection;                        /* Sensors the instance combines, as set by the user; see client_apply_policy */
+    SensorRole *roles;                      /* Use the instance makes of each registry slot */
+    gint *weights;                          /* Weight of each registry slot's reading, for POLICY_WEIGHTED */
+    guint nroles;                           /* Registry slots covered by roles and weights */
+} SampleClient;
+
+/* Ways of reading the sensors on each sample */
+
+typedef enum
+{
+    BACKEND_PREAD,                          /* One pread per sensor */
+    BACKEND_URING,                          /* All reads in one io_uring submission */
+    NUM_BACKENDS
+} ReadBackend;
+
+static const char *backend_names[NUM_BACKENDS] = { "pread", "io_uring" };
+
+/* Cost of reading the sensors, for comparing backends */
+
+typedef struct
+{
+    guint samples;                          /* Samples taken */
+    gint64 time;                            /* Total time spent reading, in us */
+    guint calls;                            /* System calls made to read */
+} ReadStats;
+
+#ifdef HAVE_LINUX_IO_URING_H
+
+typedef struct
+{
+    int fd;                                 /* Ring descriptor */
+    unsigned entries;                       /* Size of submission queue */
+    void *sq_ptr, *cq_ptr;                  /* Mappings of submission and completion rings; may be the same */
+    size_t sq_len, cq_len;
+    struct io_uring_sqe *sqes;              /* Mapping of submission queue entries */
+    size_t sqes_len;
+    unsigned *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+    int *files;                             /* Descriptors registered with the ring */
+    guint nfiles;                           /* Number of descriptors registered */
+    gboolean registered;                    /* Whether files are currently registered */
+} IoRing;
+
+#endif
+
+/* Memory-mapped history file; see cputemp-history.h */
+
+typedef struct
+{
+    int fd;                                 /* Open and locked history file */
+    CPUTempHistoryHeader *hdr;              /* Mapping of file */
+    size_t size;                            /* Size of mapping */
+} HistoryFile;
+
+/* Shared-memory segment samples are published to; see cputemp-shm.h */
+
+typedef struct
+{
+    int fd;                                 /* Open and locked segment */
+    CPUTempShmHeader *hdr;                  /* Mapping of segment */
+    size_t size;                            /* Size of mapping */
+    char name[64];                          /* Name of segment */
+    guint generation;                       /* Sensor registry generation whose labels were last published */
+    gint64 time_offset;                     /* Difference between real and monotonic time, in us */
+} SharedSamples;
+
+/* Metrics file for the node_exporter textfile collector. It is written after
+ * a sample, at most once per interval, to a temporary file which is then
+ * renamed over the real one, so the collector never sees a partial file. */
+
+typedef struct
+{
+    char *path;                             /* File written */
+    char *tmp;                              /* Temporary file written first; not ending .prom, so not collected */
+    gint64 interval;                        /* Least time between writes, in us */
+    gint64 last;                            /* Time of last write, in us */
+    gint max;                               /* Highest combined reading since last write; G_MININT if none */
+    gboolean failed;                        /* Last write failed, and has been warned about */
+} MetricsExport;
+
+/* A trace file being fed to the plugin in place of the sensors. A trace is
+ * text: a TRACE_MAGIC line, then a line per sample giving its time in us
+ * from the start of the trace, the throttle status word, the combined reading,
+ * the number of sensor slots and a reading (or '-') for each slot. Readings
+ * are in degrees, with up to two decimal places. Lines
+ * starting TRACE_SENSOR give the label of a slot; other lines starting '#'
+ * are ignored. */
+
+typedef struct
+{
+    char *path;                             /* Trace file */
+    FILE *fp;                               /* Open trace */
+    guint speed;                            /* Playback speed, as a multiple of real time */
+    gint64 start;                           /* Monotonic time at which replay started */
+    char *line;                             /* Next sample line, or NULL at end of trace */
+    size_t len;                             /* Space allocated for line */
+    guint samples;                          /* Samples replayed */
+} TraceReplay;
+
+/* Sensor and throttle state, discovered and then owned by the sampler thread.
+ * There is one sampler in the process, shared by all the plugin instances. */
+
+typedef struct
+{
+    GThread *thread;                        /* Sampler thread */
+    GMainContext *context;                  /* Main context run by sampler thread */
+    GMainLoop *loop;                        /* Main loop run by sampler thread */
+    GPtrArray *clients;                     /* Instances taking samples; changed with lock held */
+    GPtrArray *sensors;                     /* Sensor registry, indexed by slot; NULL for an empty slot */
+    gint active;                            /* Number of sensors in registry */
+    guint next_id;                          /* Last sensor id given out */
+    guint generation;                       /* Incremented when sensors are added or removed */
+    GMutex lock;                            /* Held by the sampler while changing the registry, and by others reading it */
+    gboolean ispi;
+    char *throttle_file;                    /* Optional file standing in for the firmware throttle status */
+    char *root;                             /* Prefix for sysfs and procfs paths, for testing against a copied tree */
+    gboolean hwmon;                         /* Whether hwmon sensors are used alongside thermal zones */
+    guint tick;                             /* Number of sensor reads, for pacing secondary sensors */
+    TraceReplay *replay;                    /* Trace replayed in place of the sensors, if any */
+    ThrottleSource throttle;                /* Source of throttle status */
+    GPtrArray *cpufreq;                     /* Current frequency file of each cpufreq policy */
+    guint freq_max;                         /* Highest possible frequency of any policy, in MHz */
+    guint interval;                         /* Current time between samples, in ms */
+    guint timer;                            /* Source id of the timer for the next sample */
+    gint hidden;                            /* Whether no instance's graph can be seen, so only history is being kept */
+    guint stable;                           /* Number of consecutive samples without activity */
+    gint last_temp;                         /* Combined reading in previous sample */
+    gint save_history;                      /* Whether any instance wants samples saved to the history file */
+    HistoryFile *history;                   /* History file, if being saved */
+    gboolean publish;                       /* Whether samples should be published in shared memory */
+    SharedSamples *shm;                     /* Shared-memory segment, if being published to */
+    MetricsExport *metrics;                 /* Metrics file, if being written */
+    CPUTempSample current;                  /* Sample being taken, before it is copied to each client */
+    gint backend;                           /* Requested ReadBackend */
+    ReadBackend active_backend;             /* ReadBackend in use */
+    ReadStats stats;                        /* Cost of reads since the backend was last changed */
+    gboolean instrument;                    /* Whether the counters below are kept */
+    Histogram throttle_time;                /* Time taken by throttle status reads */
+    Histogram batch_time;                   /* Time taken by batches of io_uring reads */
+    Histogram late;                         /* Lateness of sampler wakeups */
+    gint64 due;                             /* Time the next wakeup is due, in us */
+    guint missed;                           /* Wakeups late by a whole interval or more */
+    guint dropped;                          /* Samples dropped because an instance was behind */
+    guint wakeups;                          /* Times the sampler thread has woken */
+    gint64 created;                         /* Time the sampler was created, in us */
+    guint64 alloc_bytes;                    /* Bytes allocated for sample buffers */
+#ifdef HAVE_LINUX_IO_URING_H
+    IoRing *ring;                           /* Ring for batched reads, if in use */
+#endif
+} CPUTempSampler;
+
+/* The sampler shared by every instance of the plugin in the process, so that
+ * the sensors are read once however many panels show them. It is freed when
+ * the last instance goes. Only used from the main thread. */
+static CPUTempSampler *shared_sampler;
+static guint shared_refs;
+
+/* Ways of showing the individual sensors on the sample time scale */
+
+typedef enum
+{
+    VIEW_BARS,                              /* Bars for the combined reading only */
+    VIEW_LINES,                             /* A line for each sensor over the bars */
+    VIEW_HEATMAP,                           /* A row for each sensor, coloured by temperature */
+    NUM_VIEWS
+} SensorView;
+
+/* Units of the temperature label */
+
+typedef enum
+{
+    UNITS_CELSIUS,
+    UNITS_FAHRENHEIT,
+    NUM_UNITS
+} LabelUnits;
+
+/* The temperature label is drawn from pre-rendered glyphs: the digits, a
+ * minus sign, a degree sign and an F, in that order. Each is an alpha mask,
+ * so it can be drawn in any colour without rendering it again. */
+
+#define GLYPH_MINUS     10
+#define GLYPH_DEGREE    11
+#define GLYPH_F         12
+#define NUM_GLYPHS      13
+#define LABEL_NONE      G_MAXINT    /* Label value when there is no reading to show */
+
+static const char *glyph_text[NUM_GLYPHS] = { "0", "1", "2", "3", "4", "5", "6", "7", "8", "9", "-", "°", "F" };
+
+typedef struct
+{
+    cairo_surface_t *surface;               /* Glyph masks, side by side */
+    cairo_surface_t *glyph[NUM_GLYPHS];     /* Each glyph's part of the surface */
+    int fontsize;                           /* Font size rendered at; 0 if not rendered */
+    int advance;                            /* Horizontal distance between glyphs */
+    int ascent;                             /* Height of baseline from top of glyph mask */
+} GlyphAtlas;
+
+/* Bar graph rasteriser. Bars are written straight into the pixels of the
+ * graph surface a row at a time, rather than stroked one by one by cairo. The
+ * top pixel of a bar is blended with the background by how much of it the bar
+ * covers, much as cairo's antialiasing would. Where the compiler can target
+ * 128-bit vectors, four columns are worked on at once; the scalar code does
+ * the rest. The unit tests check both, at every panel size, against a
+ * per-pixel reference whose bar tops are within 1/256 of a row of cairo's. */
+
+#if defined (__SSE2__) || defined (__ARM_NEON) || defined (__ALTIVEC__)
+#define RASTER_SIMD 1
+typedef gint32 v4si __attribute__ ((vector_size (16)));
+#endif
+
+typedef struct
+{
+    guint32 background;                     /* Background, as an RGB24 pixel */
+    guint32 bar[16];                        /* Bar colour for each set of current throttle flags */
+    gint32 height;                          /* Height of graph */
+    gint32 base;                            /* Temperature at bottom of graph, in hundredths of a degree */
+    gint32 range;                           /* Temperatures spanned by graph, in hundredths of a degree */
+    gint32 scale;                           /* 256ths of a row per hundredth of a degree, scaled up by 2^shift */
+    gint32 shift;                           /* Fraction bits in scale; as many as keep scaled heights within 31 bits */
+    gint32 *temp;                           /* Temperature of each column, in hundredths of a degree; 0 for none */
+    gint32 *color;                          /* Bar colour of each column */
+    gint32 *full;                           /* First row of each column wholly covered by its bar */
+    gint32 *part;                           /* First row of each column covered at all by its bar */
+    gint32 *blend;                          /* Colour of the partly covered row of each column */
+} BarRaster;
+
+#define RASTER_ARRAYS 5                     /* Number of per-column arrays in BarRaster */
+
+/* Colours for sensor lines, used in turn */
+
+static const GdkRGBA series_colors[] = {
+    { 0.00, 0.45, 0.70, 1.0 },
+    { 0.84, 0.37, 0.00, 1.0 },
+    { 0.00, 0.62, 0.45, 1.0 },
+    { 0.80, 0.47, 0.65, 1.0 },
+    { 0.34, 0.71, 0.91, 1.0 },
+    { 0.90, 0.62, 0.00, 1.0 },
+    { 0.94, 0.89, 0.26, 1.0 },
+    { 0.00, 0.00, 0.00, 1.0 }
+};
+
+/* Recent samples, one entry per graph column. Entries are addressed by
+ * logical index, counting from the first added; the ring holds the newest
+ * capacity of them, and the graph shows the newest that fit its width. As
+ * capacity is a power of two, the slot for an index is found with a mask, and
+ * the graph can be narrowed or widened up to capacity without moving any data. */
+
+typedef struct
+{
+    gint16 *temp;                           /* Combined reading of each entry, in hundredths of a degree; 0 if empty */
+    guint16 *freq;                          /* CPU frequency of each entry, in MHz; 0 if unknown */
+    guint8 *flags;                          /* Throttle flags of each entry; see throttle_flags */
+    guint capacity;                         /* Number of entries held; a power of two */
+    gint64 head;                            /* Logical index of next entry to be added */
+} SampleRing;
+
+/* Statistics over the newest entries of the ring - those shown on the graph -
+ * updated as each entry is added, so that the ring never has to be rescanned.
+ * The lowest and highest readings are kept in monotonic deques, each holding
+ * only the entries which could still become the window's extreme, so that the
+ * extreme is always at the front and each entry is added and removed once.
+ * The mean comes from a running sum, and the smoothed reading and its rate of
+ * change are exponentially weighted averages. */
+
+typedef struct
+{
+    gint64 n;                               /* Logical index of entry */
+    gint16 temp;                            /* Reading of entry, in hundredths of a degree */
+} StatsEntry;
+
+typedef struct
+{
+    StatsEntry *entry;                      /* Ring of entries, in order of index */
+    guint head;                             /* Count of entries taken from the front */
+    guint tail;                             /* Count of entries added to the back */
+} StatsDeque;
+
+typedef struct
+{
+    StatsDeque min;                         /* Entries with readings rising from front to back */
+    StatsDeque max;                         /* Entries with readings falling from front to back */
+    guint mask;                             /* Number of slots in each deque, less one; as for the ring */
+    guint window;                           /* Number of ring entries covered */
+    gint64 first;                           /* Logical index of first entry added since reset */
+    gint64 sum;                             /* Sum of readings in window */
+    guint count;                            /* Number of readings in window */
+    double ewma;                            /* Smoothed reading, in degrees; 0 if none yet */
+    double rate;                            /* Smoothed change in reading, in degrees per minute */
+} RollingStats;
+
+/* Longer-term history, kept as fixed rings of min/max/mean buckets */
+
+typedef enum
+{
+    SCALE_SAMPLES,                          /* One column per SAMPLE_INTERVAL */
+    SCALE_MINUTES,                          /* One column per minute */
+    SCALE_QUARTERS,                         /* One column per 15 minutes */
+    NUM_SCALES
+} TimeScale;
+
+#define NUM_TIERS (NUM_SCALES - 1)
+
+typedef struct
+{
+    gint64 n;                               /* Bucket number (time / period) held in this entry */
+    gint sum;                               /* Sum of readings, in hundredths of a degree */
+    guint count;                            /* Number of readings */
+    gint16 min;                             /* Lowest reading, in hundredths of a degree */
+    gint16 max;                             /* Highest reading, in hundredths of a degree */
+    guint16 freq;                           /* Lowest CPU frequency, in MHz; 0 if unknown */
+    guint throttle;                         /* All throttle status bits seen */
+} HistoryBucket;
 
+typedef struct
+{
+    HistoryBucket *bucket;                  /* Ring of buckets, indexed by bucket number modulo size */
+    guint size;                             /* Number of buckets */
+    gint64 period;                          /* Time covered by each bucket, in us */
+    gint64 current;                         /* Bucket number of newest bucket */
+} HistoryTier;
 
-typedef gint (*GetTempFunc) (char const *);
+static const struct
+{
+    gint64 period;
+    guint size;
+} tier_spec[NUM_TIERS] = {
+    { 60 * G_USEC_PER_SEC, 24 * 60 },       /* Minutes over the last day */
+    { 900 * G_USEC_PER_SEC, 24 * 4 }        /* Quarter hours over the last day */
+};
 
 /* Private context for plugin */
 
@@ -68,444 +587,3512 @@ typedef struct
     GdkRGBA background_color;			    /* Background colour for drawing area */
     GdkRGBA low_throttle_color;			    /* Colour for bars with ARM freq cap */
     GdkRGBA high_throttle_color;			/* Colour for bars with throttling */
+    GdkRGBA freq_color;                     /* Colour for CPU frequency line */
+    gboolean show_freq;                     /* Whether the CPU frequency line is drawn */
+    guint throttle;                         /* Latest throttle status word */
+    guint freq;                             /* Latest CPU frequency, in MHz */
+    guint freq_max;                         /* Highest possible CPU frequency, in MHz; top of the frequency line */
     GtkWidget *plugin;                      /* Back pointer to the widget */
     LXPanel *panel;                         /* Back pointer to panel */
     GtkWidget *da;				            /* Drawing area */
     cairo_surface_t *pixmap;				/* Pixmap to be drawn on drawing area */
-    guint timer;				            /* Timer for periodic update */
-    float *stats_cpu;			            /* Ring buffer of temperature values */
-    int *stats_throttle;                    /* Ring buffer of throttle status */
-    unsigned int ring_cursor;			    /* Cursor for ring buffer */
-    guint pixmap_width;				        /* Width of drawing area pixmap; also size of ring buffer; does not include border size */
+    cairo_surface_t *graph;                 /* Bar graph, one column per ring buffer entry */
+    cairo_surface_t *overlay;               /* Border and text drawn over the graph */
+    int overlay_val;                        /* Temperature shown in overlay */
+    GlyphAtlas glyphs;                      /* Glyphs for the temperature label */
+    gint32 *raster;                         /* Space for the bar rasteriser's per-column arrays */
+    int label_units;                        /* Units of the temperature label (LabelUnits) */
+    int label_sensor;                       /* Sensor slot shown by the label, counting from 1; 0 for the combined reading */
+    gboolean redraw_full;                   /* Graph must be redrawn from scratch on next update */
+    guint timer;				            /* Source watching for new samples */
+    SampleRing ring;                        /* Recent samples */
+    RollingStats stats;                     /* Statistics over the samples on the graph */
+    gboolean auto_scale;                    /* Whether the temperature bounds follow the readings */
+    gint64 column_time;                     /* Monotonic time of newest ring buffer entry, in us */
+    HistoryTier tiers[NUM_TIERS];           /* Longer-term history */
+    TimeScale scale;                        /* Time scale shown on graph */
+    gint64 drawn_bucket;                    /* Newest bucket drawn on graph, when showing a history tier */
+    gint64 time_offset;                     /* Difference between real and monotonic time, in us */
+    gboolean save_history;                  /* Whether history is kept across restarts */
+    guint pixmap_width;				        /* Width of drawing area pixmap; also entries shown from ring buffer; does not include border size */
     guint pixmap_height;			        /* Height of drawing area pixmap; does not include border size */
-    int lower_temp;                         /* Temperature of bottom of graph */
-    int upper_temp;                         /* Temperature of top of graph */
-    int numsensors;
-    char *sensor_array[MAX_NUM_SENSORS];
-    GetTempFunc get_temperature[MAX_NUM_SENSORS];
-    gint temperature[MAX_NUM_SENSORS];
+    int lower_temp;                         /* Temperature of bottom of graph, as set by the user */
+    int upper_temp;                         /* Temperature of top of graph, as set by the user */
+    int view_lower;                         /* Temperature of bottom of graph as drawn; fitted to the readings when autoscaling */
+    int view_upper;                         /* Temperature of top of graph as drawn */
+    gint *temperature;                      /* Latest reading from each sensor slot, in hundredths of a degree */
+    guint *sensor_ids;                      /* Id of the sensor whose history is kept in each slot */
+    guint generation;                       /* Sensor registry generation matching sensor_ids */
+    int numsensors;                         /* Number of sensor slots in per-sensor history */
+    gint16 *sensor_stats;                   /* Per-sensor readings in hundredths of a degree, each laid out as the ring buffer's entries, one sensor after another */
+    int sensor_view;                        /* How individual sensors are shown (SensorView) */
+    int read_backend;                       /* How the sampler reads sensors (ReadBackend) */
+    int sensor_policy;                      /* How sensor readings are combined (SensorPolicy) */
+    char *sensor_select;                    /* Sensors combined; see apply_policy */
     config_setting_t *settings;
-    gboolean ispi;
+    CPUTempSampler *sampler;                /* Sensor sampling thread, shared with other instances */
+    SampleClient *client;                   /* This instance's connection to the sampler */
+    FILE *record;                           /* Trace being recorded, if any */
+    gint64 record_start;                    /* Time of first sample recorded */
+    guint record_generation;                /* Sensor registry generation whose labels were last recorded */
+    gboolean debug_tooltip;                 /* Whether the tooltip shows the instrumentation counters */
+    Histogram render_time;                  /* Time taken to take in samples and redraw */
+    guint64 alloc_bytes;                    /* Bytes allocated for sensor histories and the raster; not surfaces */
+    guint dump_signal;                      /* Source dumping statistics on SIGUSR2 */
+    gint64 start_time;                      /* Time of construction, until the first sample arrives */
+    gboolean hidden;                        /* Whether the graph can't be seen, so samples are kept but not drawn */
+    gboolean mapped;                        /* Whether the drawing area is mapped */
+    gboolean obscured;                      /* Whether the drawing area is wholly covered */
+    gboolean screensaver;                   /* Whether the screensaver is active */
+    GDBusConnection *bus;                   /* Session bus, for screensaver signals */
+    guint screensaver_sub[2];               /* Subscriptions to screensaver signals, one per interface */
+    GCancellable *cancel;                   /* Cancels connecting to the session bus */
+    guint wakeups;                          /* Times new samples have woken the main thread */
+    guint redraws;                          /* Times the pixmap has been redrawn */
 } CPUTempPlugin;
 
+/* Screensaver interfaces with an ActiveChanged signal */
+static const char *screensaver_interfaces[] = { "org.freedesktop.ScreenSaver", "org.gnome.ScreenSaver" };
+
 static void redraw_pixmap (CPUTempPlugin * c);
 static gboolean cpu_update (CPUTempPlugin * c);
 static gboolean draw (GtkWidget * widget, cairo_t * cr, CPUTempPlugin * c);
 static void cpu_destructor (gpointer user_data);
 
+/* Check the device tree model, or failing that cpuinfo, for a Raspberry Pi.
+ * The result can't change, so it is worked out once per process. */
 static gboolean is_pi (void)
 {
-    if (system ("raspi-config nonint is_pi") == 0)
-        return TRUE;
-    else
+    static gsize ispi = 0;
+    char *buf;
+    gsize res = 1;
+
+    if (g_once_init_enter (&ispi))
+    {
+        if (g_file_get_contents ("/proc/device-tree/model", &buf, NULL, NULL)
+            || g_file_get_contents ("/proc/cpuinfo", &buf, NULL, NULL))
+        {
+            if (strstr (buf, "Raspberry Pi")) res = 2;
+            g_free (buf);
+        }
+        g_once_init_leave (&ispi, res);
+    }
+    return ispi == 2;
+}
+
+/* Parse a decimal integer, skipping leading whitespace */
+static gboolean parse_int (const char *str, gint *val)
+{
+    gint res = 0;
+    gboolean neg = FALSE;
+
+    while (*str == ' ' || *str == '\t') str++;
+    if (*str == '-')
+    {
+        neg = TRUE;
+        str++;
+    }
+    if (*str < '0' || *str > '9') return FALSE;
+    while (*str >= '0' && *str <= '9') res = res * 10 + (*str++ - '0');
+    *val = neg ? -res : res;
+    return TRUE;
+}
+
+/* Readings are kept in hundredths of a degree. These convert them to whole
+ * degrees for display, and to and from decimal degrees in text files, which
+ * are written the same whatever the locale. */
+static gint whole_degrees (gint val)
+{
+    return val >= 0 ? (val + 50) / 100 : (val - 50) / 100;
+}
+
+static char *format_degrees (char *buf, gint val)
+{
+    return g_ascii_formatd (buf, G_ASCII_DTOSTR_BUF_SIZE, "%.2f", val / 100.0);
+}
+
+static gint parse_degrees (const char *str, char **end)
+{
+    double val = g_ascii_strtod (str, end);
+    return val >= 0 ? (gint) (val * 100 + 0.5) : (gint) (val * 100 - 0.5);
+}
+
+static void hist_add (Histogram *h, gint64 us)
+{
+    guint b = us > 0 ? g_bit_storage (us) : 0;
+
+    if (b >= HIST_BUCKETS) b = HIST_BUCKETS - 1;
+    h->count[b]++;
+    h->n++;
+    h->total += us;
+    if (us > h->max) h->max = us;
+}
+
+/* Upper bound of the range holding the given fraction of times, in us */
+static guint64 hist_percentile (const Histogram *h, double p)
+{
+    guint b, seen = 0;
+
+    for (b = 0; b < HIST_BUCKETS; b++)
+    {
+        seen += h->count[b];
+        if (seen && seen >= p * h->n) return MIN ((guint64) 1 << b, h->max);
+    }
+    return h->max;
+}
+
+static void hist_format (GString *str, const char *name, const Histogram *h)
+{
+    if (!h->n) return;
+    g_string_append_printf (str, "\n%s: %" G_GUINT64_FORMAT "/%" G_GUINT64_FORMAT "/%" G_GUINT64_FORMAT " us", name,
+        hist_percentile (h, 0.5), hist_percentile (h, 0.99), h->max);
+}
+
+static void hist_dump (FILE *fp, const char *name, const Histogram *h)
+{
+    guint b;
+
+    fprintf (fp, "%s: %u, mean %.1f us, max %" G_GUINT64_FORMAT " us\n", name, h->n, h->n ? (double) h->total / h->n : 0.0, h->max);
+    for (b = 0; b < HIST_BUCKETS; b++)
+        if (h->count[b]) fprintf (fp, "  < %u us: %u\n", 1U << b, h->count[b]);
+}
+
+static gboolean open_sensor (CPUTempSensor *s)
+{
+    s->fd = open (s->path, O_RDONLY | O_CLOEXEC);
+    if (s->fd < 0)
+    {
+        g_warning ("cputemp: cannot open %s", s->path);
         return FALSE;
+    }
+    return TRUE;
+}
+
+static void close_sensor (CPUTempSensor *s)
+{
+    if (s->fd >= 0) close (s->fd);
+    s->fd = -1;
+}
+
+/* Read the current contents of a sensor file into a caller-supplied buffer.
+ * The descriptor is kept open between calls; if the underlying device has
+ * gone away it is reopened once before giving up. */
+static gboolean read_sensor (CPUTempSensor *s, char *buf, size_t len)
+{
+    ssize_t n;
+
+    if (s->fd < 0 && !open_sensor (s)) return FALSE;
+
+    n = pread (s->fd, buf, len - 1, 0);
+    if (n < 0 && (errno == ENODEV || errno == ESTALE))
+    {
+        close_sensor (s);
+        if (!open_sensor (s)) return FALSE;
+        n = pread (s->fd, buf, len - 1, 0);
+    }
+    if (n <= 0) return FALSE;
+
+    buf[n] = '\0';
+    return TRUE;
+}
+
+/* Sensor parsers return readings in hundredths of a degree, or SENSOR_NONE if
+ * the contents can't be parsed, so that a failed read is never taken for a
+ * reading just below zero */
+static gint proc_parse_temperature (const char *buf)
+{
+    const char *pstr;
+    gint val;
+
+    if (!(pstr = strstr (buf, "temperature:"))) return SENSOR_NONE;
+    if (!parse_int (pstr + 12, &val)) return SENSOR_NONE;
+    return val * 100;
+}
+
+static gint sysfs_parse_temperature (const char *buf)
+{
+    gint val;
+
+    if (!parse_int (buf, &val)) return SENSOR_NONE;
+    return val / 10;
+}
+
+/* Read a sensor synchronously into its buffer and parse it */
+static gint sensor_read_temperature (CPUTempSensor *s)
+{
+    if (!read_sensor (s, s->buf, sizeof (s->buf))) return SENSOR_NONE;
+    return s->parse (s->buf);
+}
+
+/* Read the first line of a small text file, such as a sensor label */
+static char *read_label (const char *path)
+{
+    char *buf, *pp;
+
+    if (!g_file_get_contents (path, &buf, NULL, NULL)) return NULL;
+    if ((pp = strchr (buf, '\n'))) *pp = '\0';
+    if (!*buf)
+    {
+        g_free (buf);
+        return NULL;
+    }
+    return buf;
+}
+
+static CPUTempSensor *sensor_new (SensorType type, const char *name, char *path, char *label, ParseTempFunc parse)
+{
+    CPUTempSensor *s = g_new0 (CPUTempSensor, 1);
+
+    s->type = type;
+    s->name = g_strdup (name);
+    s->path = path;
+    s->label = label ? label : g_strdup (name);
+    s->fd = -1;
+    s->parse = parse;
+    s->value = SENSOR_NONE;
+    return s;
+}
+
+static void sensor_free (CPUTempSensor *s)
+{
+    close_sensor (s);
+    g_free (s->name);
+    g_free (s->path);
+    g_free (s->label);
+    g_free (s);
+}
+
+static CPUTempSensor *lookup_sensor (GPtrArray *sensors, const char *path)
+{
+    CPUTempSensor *s;
+    guint i;
+
+    for (i = 0; i < sensors->len; i++)
+    {
+        s = g_ptr_array_index (sensors, i);
+        if (s && !strcmp (s->path, path)) return s;
+    }
+    return NULL;
+}
+
+/* Sensors found by a scan. Paths already in the registry are only noted, so a
+ * rescan which finds nothing new reads no labels and makes no sensors. */
+
+typedef struct
+{
+    GPtrArray *registry;                    /* Sensors already known */
+    GHashTable *paths;                      /* Path of every sensor found */
+    GPtrArray *added;                       /* Sensors found which are not yet known */
+} SensorScan;
+
+/* Note the path of a sensor found, taking ownership of it. Returns TRUE if the
+ * sensor is new, in which case the caller adds a sensor for it. */
+static gboolean scan_found (SensorScan *scan, char *path)
+{
+    g_hash_table_add (scan->paths, path);
+    return !lookup_sensor (scan->registry, path);
+}
+
+static void find_proc_sensors (SensorScan *scan, const char *root)
+{
+    GDir *dir;
+    const char *name;
+    char *path, *base = g_build_filename (root, PROC_THERMAL_DIRECTORY, NULL);
+
+    if ((dir = g_dir_open (base, 0, NULL)))
+    {
+        while ((name = g_dir_read_name (dir)))
+        {
+            if (name[0] == '.') continue;
+            path = g_build_filename (base, name, PROC_THERMAL_TEMPF, NULL);
+            if (scan_found (scan, path))
+                g_ptr_array_add (scan->added, sensor_new (SENSOR_PROC, name, g_strdup (path), NULL, proc_parse_temperature));
+        }
+        g_dir_close (dir);
+    }
+    g_free (base);
+}
+
+static void find_thermal_sensors (SensorScan *scan, const char *root)
+{
+    GDir *dir;
+    const char *name;
+    char *path, *type, *base = g_build_filename (root, SYSFS_THERMAL_DIRECTORY, NULL);
+
+    if ((dir = g_dir_open (base, 0, NULL)))
+    {
+        while ((name = g_dir_read_name (dir)))
+        {
+            if (!g_str_has_prefix (name, SYSFS_THERMAL_SUBDIR_PREFIX)) continue;
+            path = g_build_filename (base, name, SYSFS_THERMAL_TEMPF, NULL);
+            if (!scan_found (scan, path)) continue;
+            type = g_build_filename (base, name, SYSFS_THERMAL_TYPEF, NULL);
+            g_ptr_array_add (scan->added, sensor_new (SENSOR_THERMAL, name, g_strdup (path), read_label (type), sysfs_parse_temperature));
+            g_free (type);
+        }
+        g_dir_close (dir);
+    }
+    g_free (base);
+}
+
+/* Check for a hwmon input name of the form tempN_input, returning the length of the tempN part */
+static size_t hwmon_input (const char *name)
+{
+    size_t len = strlen (name), n = 4;
+
+    if (!g_str_has_prefix (name, "temp") || !g_str_has_suffix (name, "_input")) return 0;
+    while (n < len && g_ascii_isdigit (name[n])) n++;
+    return (n > 4 && n == len - 6) ? n : 0;
+}
+
+/* Whether a thermal zone of a type has been found. A thermal zone's hwmon
+ * device is named after its type, with any '-' made '_'. */
+static gboolean scan_has_zone (SensorScan *scan, const char *chip)
+{
+    GPtrArray *lists[2] = { scan->registry, scan->added };
+    CPUTempSensor *s;
+    char *type;
+    gboolean res = FALSE;
+    guint i, j;
+
+    for (i = 0; i < 2 && !res; i++)
+    {
+        for (j = 0; j < lists[i]->len && !res; j++)
+        {
+            if (!(s = g_ptr_array_index (lists[i], j)) || s->type != SENSOR_THERMAL) continue;
+            type = g_strdelimit (g_strdup (s->label), "-", '_');
+            res = !strcmp (type, chip);
+            g_free (type);
+        }
+    }
+    return res;
+}
+
+/* Thermal zones registered with hwmon reappear as hwmon devices; those are
+ * already read through the thermal class, so are recognised and skipped. On
+ * some kernels the device links back to its zone; on others it has no parent,
+ * and is known only by its name. */
+static gboolean hwmon_is_thermal_zone (SensorScan *scan, const char *hwmon, const char *chip)
+{
+    char *link = g_build_filename (hwmon, "device", NULL);
+    char *dev = realpath (link, NULL);
+    gboolean res = dev && strstr (dev, "/" SYSFS_THERMAL_SUBDIR_PREFIX);
+
+    if (!res && chip) res = scan_has_zone (scan, chip);
+    free (dev);
+    g_free (link);
+    return res;
+}
+
+/* Find the inputs of a hwmon device in a directory; returns FALSE if there are
+ * none. The device's name is only read, and the device only checked against
+ * the thermal zones, if it has inputs not already known. */
+static gboolean find_hwmon_inputs (SensorScan *scan, const char *hwmon, const char *base, const char *path)
+{
+    GDir *dir;
+    const char *name;
+    char *chip = NULL, *label, *tmp, *id;
+    size_t len;
+    gboolean any = FALSE, checked = FALSE, zone = FALSE;
+
+    if (!(dir = g_dir_open (path, 0, NULL))) return FALSE;
+
+    while ((name = g_dir_read_name (dir)))
+    {
+        if (!(len = hwmon_input (name))) continue;
+        any = TRUE;
+        if (!scan_found (scan, g_build_filename (path, name, NULL))) continue;
+
+        if (!checked)
+        {
+            tmp = g_build_filename (path, "name", NULL);
+            chip = read_label (tmp);
+            g_free (tmp);
+            zone = hwmon_is_thermal_zone (scan, base, chip);
+            checked = TRUE;
+        }
+        if (zone) continue;
+
+        tmp = g_strdup_printf ("%s/%.*s_label", path, (int) len, name);
+        if (!(label = read_label (tmp)))
+            label = chip ? g_strdup_printf ("%s %.*s", chip, (int) len, name) : g_strndup (name, len);
+        g_free (tmp);
+        id = g_strdup_printf ("%s/%.*s", hwmon, (int) len, name);
+        g_ptr_array_add (scan->added, sensor_new (SENSOR_HWMON, id, g_build_filename (path, name, NULL), label, sysfs_parse_temperature));
+        g_free (id);
+    }
+
+    g_free (chip);
+    g_dir_close (dir);
+    return any;
+}
+
+static void find_hwmon_sensors (SensorScan *scan, const char *root)
+{
+    GDir *dir;
+    const char *name;
+    char *path, *dev, *base = g_build_filename (root, SYSFS_HWMON_DIRECTORY, NULL);
+
+    if ((dir = g_dir_open (base, 0, NULL)))
+    {
+        while ((name = g_dir_read_name (dir)))
+        {
+            if (!g_str_has_prefix (name, "hwmon")) continue;
+            path = g_build_filename (base, name, NULL);
+
+            /* Older drivers put their inputs under device/ */
+            dev = g_build_filename (path, "device", NULL);
+            if (!find_hwmon_inputs (scan, name, path, dev)) find_hwmon_inputs (scan, name, path, path);
+            g_free (dev);
+            g_free (path);
+        }
+        g_dir_close (dir);
+    }
+    g_free (base);
+}
+
+static void free_sensors (CPUTempSampler *sm)
+{
+    guint i;
+
+    for (i = 0; i < sm->sensors->len; i++)
+        if (g_ptr_array_index (sm->sensors, i)) sensor_free (g_ptr_array_index (sm->sensors, i));
+    g_ptr_array_set_size (sm->sensors, 0);
+}
+
+/* Work out the use an instance makes of each sensor from its policy and
+ * selection. The selection is a comma-separated list of sensor names or
+ * labels, which may use * and ? wildcards, each optionally followed by a colon
+ * and a whole number weight; an empty selection takes in every sensor with
+ * weight 1. A sensor with weight 0 is still shown, but is not combined into
+ * the reading, and under POLICY_PRIMARY only the first selected sensor is
+ * combined: the one matching the earliest item of the selection, or the
+ * earliest in the registry of those matching the same item. Run with the
+ * registry locked. */
+static void client_apply_policy (CPUTempSampler *sm, SampleClient *cl)
+{
+    gchar **items = NULL, *item, *colon;
+    CPUTempSensor *s;
+    guint i, j, n = 0, primary = G_MAXUINT, primary_item = 0;
+    gint weight;
+
+    if (cl->nroles != sm->sensors->len)
+    {
+        cl->nroles = sm->sensors->len;
+        cl->roles = g_renew (SensorRole, cl->roles, cl->nroles);
+        cl->weights = g_renew (gint, cl->weights, cl->nroles);
+    }
+    if (cl->selection && *cl->selection)
+    {
+        items = g_strsplit (cl->selection, ",", -1);
+        n = g_strv_length (items);
+    }
+
+    for (i = 0; i < cl->nroles; i++)
+    {
+        cl->roles[i] = ROLE_UNUSED;
+        cl->weights[i] = 1;
+        if (!(s = g_ptr_array_index (sm->sensors, i))) continue;
+        if (!n) cl->roles[i] = ROLE_NEEDED;
+        for (j = 0; j < n; j++)
+        {
+            item = g_strstrip (g_strdup (items[j]));
+            weight = 1;
+            if ((colon = strchr (item, ':')))
+            {
+                *colon = '\0';
+                if (!parse_int (colon + 1, &weight) || weight < 0) weight = 1;
+                g_strchomp (item);
+            }
+            if (*item && (g_pattern_match_simple (item, s->name) || g_pattern_match_simple (item, s->label)))
+            {
+                cl->roles[i] = weight ? ROLE_NEEDED : ROLE_SECONDARY;
+                cl->weights[i] = weight;
+                g_free (item);
+                break;
+            }
+            g_free (item);
+        }
+
+        if (cl->roles[i] == ROLE_NEEDED && (primary == G_MAXUINT || j < primary_item))
+        {
+            primary = i;
+            primary_item = j;
+        }
+    }
+    g_strfreev (items);
+
+    if (cl->policy != POLICY_PRIMARY) return;
+    for (i = 0; i < cl->nroles; i++)
+        if (i != primary && cl->roles[i] == ROLE_NEEDED) cl->roles[i] = ROLE_SECONDARY;
+}
+
+/* Give each sensor the most use any instance makes of it, so that the sampler
+ * reads every sensor that some instance needs. Run in the sampler thread, or
+ * before it starts, with the registry locked. */
+static void merge_roles (CPUTempSampler *sm)
+{
+    CPUTempSensor *s;
+    SampleClient *cl;
+    guint i, j;
+
+    for (i = 0; i < sm->sensors->len; i++)
+    {
+        if (!(s = g_ptr_array_index (sm->sensors, i))) continue;
+        s->role = ROLE_UNUSED;
+        for (j = 0; j < sm->clients->len; j++)
+        {
+            cl = g_ptr_array_index (sm->clients, j);
+            if (i < cl->nroles && cl->roles[i] < s->role) s->role = cl->roles[i];
+        }
+    }
+}
+
+/* Work out every instance's use of the sensors again, after the registry
+ * has changed. Run in the sampler thread, with the registry locked. */
+static void apply_policy (CPUTempSampler *sm)
+{
+    guint i;
+
+    for (i = 0; i < sm->clients->len; i++) client_apply_policy (sm, g_ptr_array_index (sm->clients, i));
+    merge_roles (sm);
+}
+
+/* Combine the sensor readings in a sample by an instance's policy. Returns
+ * COMBINED_NONE if the instance needs none of the sensors read. Run with
+ * the lock held. */
+static gint combine_readings (const SampleClient *cl, const CPUTempSample *smp)
+{
+    gint max = COMBINED_NONE, val, weight, i, count = 0;
+    gint64 sum = 0;
+
+    for (i = 0; i < smp->numsensors && i < cl->nroles; i++)
+    {
+        if (cl->roles[i] != ROLE_NEEDED || (val = smp->temperature[i]) == SENSOR_NONE) continue;
+        if (val > max) max = val;
+        weight = cl->policy == POLICY_WEIGHTED ? cl->weights[i] : 1;
+        sum += (gint64) val * weight;
+        count += weight;
+    }
+
+    /* Under POLICY_PRIMARY there is only one sensor needed, so any policy gives its reading */
+    if (cl->policy == POLICY_MAX || cl->policy == POLICY_PRIMARY || !count) return max;
+    return sum >= 0 ? (sum + count / 2) / count : (sum - count / 2) / count;
+}
+
+/* Whether a sensor is to be read in the current sample */
+static gboolean sensor_due (CPUTempSampler *sm, CPUTempSensor *s)
+{
+    if (s->role == ROLE_UNUSED) return FALSE;
+    return s->role == ROLE_NEEDED || sm->tick % SENSOR_SECONDARY_RATE == 0;
+}
+
+/* Bring the sensor registry up to date with the system. Sensors which have
+ * gone are removed and new ones added, leaving the rest untouched, so each
+ * sensor keeps its slot (and so its history) for as long as it exists. A new
+ * sensor may take over an empty slot; it gets a new id so that the main thread
+ * knows to start a fresh history for it. */
+static void check_sensors (CPUTempSampler *sm)
+{
+    SensorScan scan;
+    CPUTempSensor *s;
+    gboolean changed = FALSE;
+    guint i, j;
+
+    /* The registry is only changed in this thread, so can be read unlocked */
+    scan.registry = sm->sensors;
+    scan.paths = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+    scan.added = g_ptr_array_new ();
+    find_proc_sensors (&scan, sm->root);
+    find_thermal_sensors (&scan, sm->root);
+
+    /* Many hwmon sensors, such as those of NVMe drives, power management ICs
+     * and ambient sensors, say nothing about the CPU, so they are only used
+     * where there are no thermal zones, unless asked for. */
+    if (sm->hwmon || !g_hash_table_size (scan.paths)) find_hwmon_sensors (&scan, sm->root);
+
+    g_mutex_lock (&sm->lock);
+    for (i = 0; i < sm->sensors->len; i++)
+    {
+        s = g_ptr_array_index (sm->sensors, i);
+        if (!s || g_hash_table_contains (scan.paths, s->path)) continue;
+        g_message ("cputemp: Removed sensor %s (%s)", s->path, s->label);
+        sensor_free (s);
+        g_ptr_array_index (sm->sensors, i) = NULL;
+        sm->active--;
+        changed = TRUE;
+    }
+    for (i = 0, j = 0; i < scan.added->len; i++)
+    {
+        s = g_ptr_array_index (scan.added, i);
+        s->id = ++sm->next_id;
+        open_sensor (s);
+        while (j < sm->sensors->len && g_ptr_array_index (sm->sensors, j)) j++;
+        if (j < sm->sensors->len) g_ptr_array_index (sm->sensors, j) = s;
+        else g_ptr_array_add (sm->sensors, s);
+        sm->active++;
+        changed = TRUE;
+        g_message ("cputemp: Added sensor %s (%s)", s->path, s->label);
+    }
+    if (changed)
+    {
+        apply_policy (sm);
+        sm->generation++;
+    }
+    g_mutex_unlock (&sm->lock);
+
+    g_ptr_array_free (scan.added, TRUE);
+    g_hash_table_destroy (scan.paths);
+    if (changed) g_message ("cputemp: Found %d sensors", sm->active);
+}
+
+/* Periodic rescan, run in the sampler thread, to pick up hotplugged sensors */
+static gboolean sampler_rescan (CPUTempSampler *sm)
+{
+    sm->wakeups++;
+    check_sensors (sm);
+    return TRUE;
+}
+
+/* Pack the throttle status word into the flags of a ring entry: the current
+ * conditions in the low four bits and the sticky ones in the high four. */
+static guint8 throttle_flags (guint throttle)
+{
+    return (throttle & 0xF) | ((throttle >> 12) & 0xF0);
+}
+
+static guint ring_slot (const SampleRing *r, gint64 n)
+{
+    return n & (r->capacity - 1);
+}
+
+/* Copy the entries of one ring buffer layout into another of a different
+ * capacity, keeping each entry at its logical index. */
+static void ring_relayout (void *dst, const void *src, size_t size, guint old_capacity, guint new_capacity, gint64 head)
+{
+    gint64 n;
+
+    for (n = MAX (head - MIN (old_capacity, new_capacity), 0); n < head; n++)
+        memcpy ((char *) dst + (n & (new_capacity - 1)) * size, (const char *) src + (n & (old_capacity - 1)) * size, size);
+}
+
+/* Make sure the ring can hold a graph of the given width, growing it if not.
+ * Returns TRUE if it grew, in which case any arrays laid out in parallel with
+ * it must be relaid to match. */
+static gboolean ring_reserve (SampleRing *r, guint width)
+{
+    guint capacity = MAX (r->capacity, RING_MIN_CAPACITY);
+    gint16 *temp;
+    guint16 *freq;
+    guint8 *flags;
+
+    while (capacity < width) capacity <<= 1;
+    if (capacity == r->capacity) return FALSE;
+
+    temp = g_malloc0 (capacity * (sizeof (gint16) + sizeof (guint16) + sizeof (guint8)));
+    freq = (guint16 *) (temp + capacity);
+    flags = (guint8 *) (freq + capacity);
+    if (r->capacity)
+    {
+        ring_relayout (temp, r->temp, sizeof (gint16), r->capacity, capacity, r->head);
+        ring_relayout (freq, r->freq, sizeof (guint16), r->capacity, capacity, r->head);
+        ring_relayout (flags, r->flags, sizeof (guint8), r->capacity, capacity, r->head);
+        g_free (r->temp);
+    }
+    r->temp = temp;
+    r->freq = freq;
+    r->flags = flags;
+    r->capacity = capacity;
+    return TRUE;
+}
+
+/* Add an entry, returning the slot it went in */
+static guint ring_push (SampleRing *r, gint16 temp, guint8 flags, guint16 freq)
+{
+    guint i = ring_slot (r, r->head++);
+
+    r->temp[i] = temp;
+    r->freq[i] = freq;
+    r->flags[i] = flags;
+    return i;
+}
+
+static void ring_free (SampleRing *r)
+{
+    g_free (r->temp);
+}
+
+/* Add an entry to the back of a deque, first dropping any entries which it
+ * beats, as they can no longer be the extreme while it is in the window. */
+static void deque_push (StatsDeque *d, guint mask, gint64 n, gint16 temp, gboolean max)
+{
+    StatsEntry *e;
+
+    while (d->tail != d->head)
+    {
+        e = &d->entry[(d->tail - 1) & mask];
+        if (max ? e->temp > temp : e->temp < temp) break;
+        d->tail--;
+    }
+    e = &d->entry[d->tail++ & mask];
+    e->n = n;
+    e->temp = temp;
+}
+
+/* Drop entries older than the window from the front of a deque */
+static void deque_expire (StatsDeque *d, guint mask, gint64 oldest)
+{
+    while (d->head != d->tail && d->entry[d->head & mask].n < oldest) d->head++;
+}
+
+/* Take in ring entry n, with the reading about to be stored in it. This must
+ * be called before the entry is added, as the entry leaving the window may
+ * share its slot. */
+static void stats_add (RollingStats *s, const SampleRing *r, gint64 n, gint16 temp)
+{
+    gint64 old = n - s->window;
+    double prev = s->ewma;
+    gint16 val;
+
+    if (old >= s->first && (val = r->temp[ring_slot (r, old)]))
+    {
+        s->sum -= val;
+        s->count--;
+    }
+    deque_expire (&s->min, s->mask, old + 1);
+    deque_expire (&s->max, s->mask, old + 1);
+    if (!temp) return;
+
+    s->sum += temp;
+    s->count++;
+    deque_push (&s->min, s->mask, n, temp, FALSE);
+    deque_push (&s->max, s->mask, n, temp, TRUE);
+
+    /* Each entry covers SAMPLE_INTERVAL, so the rate is scaled to a minute */
+    if (!prev) s->ewma = temp / 100.0;
+    else
+    {
+        s->ewma += STATS_EWMA_WEIGHT * (temp / 100.0 - s->ewma);
+        s->rate += STATS_EWMA_WEIGHT * ((s->ewma - prev) * 60000 / SAMPLE_INTERVAL - s->rate);
+    }
+}
+
+/* Start again over a new window, by taking in the entries already in it. Only
+ * needed when the graph is resized or the ring is refilled. */
+static void stats_reset (RollingStats *s, const SampleRing *r, guint window)
+{
+    gint64 n;
+
+    if (s->mask + 1 != r->capacity)
+    {
+        g_free (s->min.entry);
+        s->min.entry = g_new (StatsEntry, 2 * r->capacity);
+        s->max.entry = s->min.entry + r->capacity;
+        s->mask = r->capacity - 1;
+    }
+    s->min.head = s->min.tail = s->max.head = s->max.tail = 0;
+    s->window = window;
+    s->first = MAX (r->head - window, 0);
+    s->sum = 0;
+    s->count = 0;
+    s->ewma = 0;
+    s->rate = 0;
+    for (n = s->first; n < r->head; n++) stats_add (s, r, n, r->temp[ring_slot (r, n)]);
+}
+
+static void stats_free (RollingStats *s)
+{
+    g_free (s->min.entry);
+}
+
+/* Lowest and highest readings in the window, in hundredths of a degree; only
+ * valid if count is non-zero. */
+static gint stats_min (const RollingStats *s)
+{
+    return s->min.entry[s->min.head & s->mask].temp;
+}
+
+static gint stats_max (const RollingStats *s)
+{
+    return s->max.entry[s->max.head & s->mask].temp;
+}
+
+/* Add a reading to a history tier, starting a new bucket if its period has passed. */
+static void history_add (HistoryTier *h, gint64 time, gint temp, guint throttle, guint freq)
+{
+    gint64 n = time / h->period;
+    HistoryBucket *b = &h->bucket[n % h->size];
+
+    if (b->n != n || !b->count)
+    {
+        b->n = n;
+        b->sum = 0;
+        b->count = 0;
+        b->min = temp;
+        b->max = temp;
+        b->freq = 0;
+        b->throttle = 0;
+    }
+    b->sum += temp;
+    b->count++;
+    if (temp < b->min) b->min = temp;
+    if (temp > b->max) b->max = temp;
+    if (freq && (!b->freq || freq < b->freq)) b->freq = freq;
+    b->throttle |= throttle;
+    h->current = n;
+}
+
+/* Look up a bucket by number, returning NULL if it holds no readings. */
+static HistoryBucket *history_bucket (HistoryTier *h, gint64 n)
+{
+    HistoryBucket *b;
+
+    if (n < 0) return NULL;
+    b = &h->bucket[n % h->size];
+    return (b->n == n && b->count) ? b : NULL;
+}
+
+/* Graph column showing the oldest entry on the current time scale. */
+static unsigned int graph_cursor (CPUTempPlugin *c)
+{
+    if (c->scale == SCALE_SAMPLES) return c->ring.head % c->pixmap_width;
+    return (c->tiers[c->scale - 1].current + 1) % c->pixmap_width;
+}
+
+/* Vertical position on the graph of a temperature. */
+static double temp_to_y (CPUTempPlugin *c, float temp)
+{
+    return c->pixmap_height - (temp - c->view_lower) * c->pixmap_height / (c->view_upper - c->view_lower);
+}
+
+/* Set a colour between the foreground and throttled colours, by temperature. */
+static void set_heat_color (CPUTempPlugin *c, cairo_t *cr, float temp)
+{
+    GdkRGBA *cool = &c->foreground_color, *hot = &c->high_throttle_color;
+    float f = (temp - c->view_lower) / (c->view_upper - c->view_lower);
+    f = CLAMP (f, 0.0, 1.0);
+    cairo_set_source_rgb (cr, cool->red + f * (hot->red - cool->red),
+        cool->green + f * (hot->green - cool->green), cool->blue + f * (hot->blue - cool->blue));
+}
+
+/* Draw the individual sensors for ring buffer entry n, as selected. A sensor
+ * line is drawn as a vertical run from the previous entry's value to this
+ * one's, so each column can be drawn on its own. */
+static void draw_sensors (CPUTempPlugin *c, cairo_t *cr, gint64 n)
+{
+    SampleRing *r = &c->ring;
+    unsigned int x = n % c->pixmap_width, i = ring_slot (r, n), prev = ring_slot (r, n - 1);
+    gboolean oldest = n <= r->head - c->pixmap_width;
+    gint16 *series;
+    double row, y0, y1;
+    int s;
+
+    row = (double) c->pixmap_height / c->numsensors;
+    for (s = 0; s < c->numsensors; s++)
+    {
+        series = &c->sensor_stats[s * r->capacity];
+        if (!series[i]) continue;
+        if (c->sensor_view == VIEW_HEATMAP)
+        {
+            set_heat_color (c, cr, series[i] / 100.0);
+            cairo_rectangle (cr, x, s * row, 1, row);
+            cairo_fill (cr);
+        }
+        else
+        {
+            gdk_cairo_set_source_rgba (cr, &series_colors[s % G_N_ELEMENTS (series_colors)]);
+            y1 = temp_to_y (c, series[i] / 100.0);
+            y0 = (!oldest && series[prev]) ? temp_to_y (c, series[prev] / 100.0) : y1;
+            cairo_move_to (cr, x + 0.5, MIN (y0, y1) - 0.5);
+            cairo_line_to (cr, x + 0.5, MAX (y0, y1) + 0.5);
+            cairo_stroke (cr);
+        }
+    }
+}
+
+static guint32 rgb24 (const GdkRGBA *color)
+{
+    return ((guint32) (color->red * 255.0 + 0.5) << 16) | ((guint32) (color->green * 255.0 + 0.5) << 8)
+        | (guint32) (color->blue * 255.0 + 0.5);
+}
+
+static void raster_setup (CPUTempPlugin *c, BarRaster *br, gint32 *space, guint width)
+{
+    int i;
+
+    br->background = rgb24 (&c->background_color);
+    for (i = 0; i < 16; i++)
+    {
+        if (i & 0x8) br->bar[i] = rgb24 (&c->high_throttle_color);
+        else if (i & 0x2) br->bar[i] = rgb24 (&c->low_throttle_color);
+        else br->bar[i] = rgb24 (&c->foreground_color);
+    }
+    br->height = c->pixmap_height;
+    br->base = c->view_lower * 100;
+    br->range = MAX (c->view_upper - c->view_lower, 1) * 100;
+    br->shift = 30 - 8 - g_bit_storage (br->height);
+    br->scale = (((gint64) br->height << (8 + br->shift)) + br->range - 1) / br->range;
+    br->temp = space;
+    br->color = space + width;
+    br->full = space + 2 * width;
+    br->part = space + 3 * width;
+    br->blend = space + 4 * width;
+}
+
+/* Work out the rows covered by the bars of columns x0 to x1, and the colour
+ * of each partly covered row. */
+static void raster_columns_scalar (BarRaster *br, int x0, int x1)
+{
+    gint32 d, y, cov, col, blend, ch, b, f;
+    int x;
+
+    for (x = x0; x < x1; x++)
+    {
+        d = CLAMP (br->temp[x] - br->base, 0, br->range);
+        y = br->temp[x] ? MAX ((br->height << 8) - ((d * br->scale) >> br->shift), 0) : br->height << 8;
+        br->part[x] = y >> 8;
+        br->full[x] = (y + 255) >> 8;
+
+        cov = 256 - (y & 255);
+        col = br->color[x];
+        blend = 0;
+        for (ch = 0; ch <= 16; ch += 8)
+        {
+            b = (br->background >> ch) & 255;
+            f = (col >> ch) & 255;
+            blend |= ((b + (((f - b) * cov + 128) >> 8)) & 255) << ch;
+        }
+        br->blend[x] = blend;
+    }
+}
+
+static void raster_rows_scalar (BarRaster *br, guint32 *data, int stride, int x0, int x1)
+{
+    guint32 *row;
+    int x, y;
+
+    for (y = 0, row = data; y < br->height; y++, row += stride)
+    {
+        for (x = x0; x < x1; x++)
+        {
+            if (y >= br->full[x]) row[x] = br->color[x];
+            else if (y >= br->part[x]) row[x] = br->blend[x];
+            else row[x] = br->background;
+        }
+    }
+}
+
+#ifdef RASTER_SIMD
+
+static inline v4si v4si_load (const gint32 *p)
+{
+    v4si v;
+    memcpy (&v, p, sizeof (v));
+    return v;
+}
+
+static inline void v4si_store (void *p, v4si v)
+{
+    memcpy (p, &v, sizeof (v));
+}
+
+/* As raster_columns_scalar, four columns at a time; returns the first column not done */
+static int raster_columns_simd (BarRaster *br, int x0, int x1)
+{
+    const v4si zero = { 0, 0, 0, 0 }, byte = { 255, 255, 255, 255 }, round = { 128, 128, 128, 128 };
+    const v4si base = zero + br->base, range = zero + br->range, scale = zero + br->scale;
+    const v4si height8 = zero + (br->height << 8), bg = zero + (gint32) br->background;
+    v4si t, d, m, y, cov, col, blend, b, f;
+    int x, ch;
+
+    for (x = x0; x + 4 <= x1; x += 4)
+    {
+        t = v4si_load (&br->temp[x]);
+        d = t - base;
+        d &= ~(d < zero);
+        m = d > range;
+        d = (d & ~m) | (range & m);
+        m = t == zero;
+        y = height8 - ((d * scale) >> br->shift);
+        y &= ~(y < zero);
+        y = (height8 & m) | (y & ~m);
+        v4si_store (&br->part[x], y >> 8);
+        v4si_store (&br->full[x], (y + byte) >> 8);
+
+        cov = (zero + 256) - (y & byte);
+        col = v4si_load (&br->color[x]);
+        blend = zero;
+        for (ch = 0; ch <= 16; ch += 8)
+        {
+            b = (bg >> ch) & byte;
+            f = (col >> ch) & byte;
+            blend |= ((b + (((f - b) * cov + round) >> 8)) & byte) << ch;
+        }
+        v4si_store (&br->blend[x], blend);
+    }
+    return x;
+}
+
+/* As raster_rows_scalar, four columns at a time; returns the first column not done */
+static int raster_rows_simd (BarRaster *br, guint32 *data, int stride, int x0, int x1)
+{
+    const v4si zero = { 0, 0, 0, 0 }, bg = zero + (gint32) br->background;
+    v4si full, part, col, blend, row, mf, mp;
+    guint32 *p;
+    int x, y;
+
+    for (x = x0; x + 4 <= x1; x += 4)
+    {
+        full = v4si_load (&br->full[x]);
+        part = v4si_load (&br->part[x]);
+        col = v4si_load (&br->color[x]);
+        blend = v4si_load (&br->blend[x]);
+        for (y = 0, p = data + x; y < br->height; y++, p += stride)
+        {
+            row = zero + y;
+            mf = row >= full;
+            mp = row >= part;
+            v4si_store (p, (col & mf) | (blend & mp & ~mf) | (bg & ~mp));
+        }
+    }
+    return x;
+}
+
+#endif
+
+/* Write the bars for columns x0 to x1 into pixel data, from the temperatures
+ * and colours already set in the rasteriser. */
+static void raster_bars (BarRaster *br, guint32 *data, int stride, int x0, int x1, gboolean simd)
+{
+    int x = x0;
+
+#ifdef RASTER_SIMD
+    if (simd) x = raster_columns_simd (br, x0, x1);
+#endif
+    raster_columns_scalar (br, x, x1);
+
+    x = x0;
+#ifdef RASTER_SIMD
+    if (simd) x = raster_rows_simd (br, data, stride, x0, x1);
+#endif
+    raster_rows_scalar (br, data, stride, x, x1);
+}
+
+/* Set the bar temperature and colour of graph columns x0 to x1 from the ring
+ * buffer entries or history buckets they show. */
+static void raster_gather (CPUTempPlugin *c, BarRaster *br, HistoryTier *h, int x0, int x1)
+{
+    gint64 last = h ? h->current : c->ring.head - 1, n;
+    gint w = c->pixmap_width;
+    gboolean bars = h || c->sensor_view != VIEW_HEATMAP || !c->numsensors;
+    HistoryBucket *b;
+    guint i;
+    int x;
+
+    for (x = x0; x < x1; x++)
+    {
+        n = last - (((last - x) % w + w) % w);
+        br->temp[x] = 0;
+        br->color[x] = br->bar[0];
+        if (h)
+        {
+            if (!(b = history_bucket (h, n))) continue;
+            br->temp[x] = b->max;
+            br->color[x] = br->bar[b->throttle & 0xF];
+        }
+        else if (bars && n >= 0)
+        {
+            i = ring_slot (&c->ring, n);
+            br->temp[x] = c->ring.temp[i];
+            br->color[x] = br->bar[c->ring.flags[i] & 0xF];
+        }
+    }
+}
+
+/* CPU frequency of a ring buffer entry or history bucket, in MHz; 0 if unknown */
+static guint entry_freq (CPUTempPlugin *c, HistoryTier *h, gint64 n)
+{
+    HistoryBucket *b;
+
+    if (h) return (b = history_bucket (h, n)) ? b->freq : 0;
+    return n >= 0 ? c->ring.freq[ring_slot (&c->ring, n)] : 0;
+}
+
+static int freq_to_y (CPUTempPlugin *c, guint freq)
+{
+    int y = (c->pixmap_height - 1) - (gint64) freq * (c->pixmap_height - 1) / c->freq_max;
+    return CLAMP (y, 0, (int) c->pixmap_height - 1);
+}
+
+/* Draw the CPU frequency line over columns x0 to x1, with the highest possible
+ * frequency at the top of the graph. As with the sensor lines, each column is
+ * a vertical run from the previous entry's frequency to its own. */
+static void raster_freq (CPUTempPlugin *c, HistoryTier *h, guint32 *data, int stride, int x0, int x1)
+{
+    gint64 last = h ? h->current : c->ring.head - 1, n;
+    gint w = c->pixmap_width;
+    guint32 color = rgb24 (&c->freq_color);
+    guint freq, prev;
+    int x, y, y0, y1;
+
+    for (x = x0; x < x1; x++)
+    {
+        n = last - (((last - x) % w + w) % w);
+        if (!(freq = entry_freq (c, h, n))) continue;
+        prev = n > last - w + 1 ? entry_freq (c, h, n - 1) : 0;
+        y1 = freq_to_y (c, freq);
+        y0 = prev ? freq_to_y (c, prev) : y1;
+        for (y = MIN (y0, y1); y <= MAX (y0, y1); y++) data[y * stride + x] = color;
+    }
+}
+
+/* Update the graph surface. Column i of the surface always shows the ring
+ * buffer entry or history bucket whose index is i modulo width, so after a new
+ * sample only that one column needs to be redrawn; the cursor is applied when
+ * the graph is composited. */
+static void redraw_graph (CPUTempPlugin *c, gboolean full)
+{
+    HistoryTier *h = c->scale == SCALE_SAMPLES ? NULL : &c->tiers[c->scale - 1];
+    BarRaster br;
+    unsigned int i, x0, x1;
+    guint32 *data = (guint32 *) cairo_image_surface_get_data (c->graph);
+    int stride = cairo_image_surface_get_stride (c->graph) / 4;
+    cairo_t *cr;
+
+    /* A new history bucket moves the time window, which needs a full redraw. */
+    if (h && h->current != c->drawn_bucket) full = TRUE;
+    if (h) c->drawn_bucket = h->current;
+
+    /* Redraw the whole graph, or just the column for the newest sample or bucket. */
+    if (full)
+    {
+        x0 = 0;
+        x1 = c->pixmap_width;
+    }
+    else
+    {
+        x0 = (h ? h->current : c->ring.head - 1) % c->pixmap_width;
+        x1 = x0 + 1;
+    }
+
+    raster_setup (c, &br, c->raster, c->pixmap_width);
+    raster_gather (c, &br, h, x0, x1);
+    cairo_surface_flush (c->graph);
+    raster_bars (&br, data, stride, x0, x1, TRUE);
+    cairo_surface_mark_dirty_rectangle (c->graph, x0, 0, x1 - x0, c->pixmap_height);
+
+    /* Individual sensors are drawn over the bars by cairo. */
+    if (!h && c->sensor_view != VIEW_BARS && c->numsensors)
+    {
+        cr = cairo_create (c->graph);
+        cairo_set_line_width (cr, 1.0);
+        if (full)
+            for (i = 0; i < c->pixmap_width && i < c->ring.head; i++) draw_sensors (c, cr, c->ring.head - 1 - i);
+        else draw_sensors (c, cr, c->ring.head - 1);
+        cairo_destroy (cr);
+    }
+
+    /* The frequency line goes over everything else. */
+    if (c->show_freq && c->freq_max)
+    {
+        cairo_surface_flush (c->graph);
+        raster_freq (c, h, data, stride, x0, x1);
+        cairo_surface_mark_dirty_rectangle (c->graph, x0, 0, x1 - x0, c->pixmap_height);
+    }
+}
+
+static void glyphs_free (GlyphAtlas *g)
+{
+    int i;
+
+    if (!g->surface) return;
+    for (i = 0; i < NUM_GLYPHS; i++) cairo_surface_destroy (g->glyph[i]);
+    cairo_surface_destroy (g->surface);
+    g->surface = NULL;
+    g->fontsize = 0;
+}
+
+/* Render the label glyphs at a font size; only needed when the size changes. */
+static void glyphs_render (GlyphAtlas *g, int fontsize)
+{
+    cairo_font_extents_t fe;
+    cairo_surface_t *surface;
+    cairo_t *cr;
+    int i, height;
+
+    glyphs_free (g);
+
+    /* Measure the font, then render each glyph into its own cell. */
+    surface = cairo_image_surface_create (CAIRO_FORMAT_A8, 1, 1);
+    cr = cairo_create (surface);
+    cairo_select_font_face (cr, "monospace", CAIRO_FONT_SLANT_NORMAL, CAIRO_FONT_WEIGHT_NORMAL);
+    cairo_set_font_size (cr, fontsize);
+    cairo_font_extents (cr, &fe);
+    cairo_destroy (cr);
+    cairo_surface_destroy (surface);
+
+    g->advance = fe.max_x_advance + 0.5;
+    g->ascent = fe.ascent + 0.5;
+    height = fe.ascent + fe.descent + 1;
+    g->surface = cairo_image_surface_create (CAIRO_FORMAT_A8, g->advance * NUM_GLYPHS, height);
+    cr = cairo_create (g->surface);
+    cairo_select_font_face (cr, "monospace", CAIRO_FONT_SLANT_NORMAL, CAIRO_FONT_WEIGHT_NORMAL);
+    cairo_set_font_size (cr, fontsize);
+    for (i = 0; i < NUM_GLYPHS; i++)
+    {
+        cairo_move_to (cr, i * g->advance, g->ascent);
+        cairo_show_text (cr, glyph_text[i]);
+        g->glyph[i] = cairo_surface_create_for_rectangle (g->surface, i * g->advance, 0, g->advance, height);
+    }
+    cairo_destroy (cr);
+    cairo_surface_flush (g->surface);
+    g->fontsize = fontsize;
+}
+
+/* Value shown by the label, in whole degrees of the chosen units */
+static int label_value (CPUTempPlugin *c)
+{
+    int n = c->label_sensor - 1, val;
+
+    if (n < 0)
+    {
+        if (!(val = c->ring.temp[ring_slot (&c->ring, c->ring.head - 1)])) return LABEL_NONE;
+    }
+    else if (n < c->numsensors && c->temperature[n] != SENSOR_NONE) val = c->temperature[n];
+    else return LABEL_NONE;
+
+    if (c->label_units == UNITS_FAHRENHEIT) val = val * 9 / 5 + 3200;
+    return whole_degrees (val);
+}
+
+/* Draw the label, right-aligning the number in three places as "%3d°" would. */
+static void draw_label (CPUTempPlugin *c, cairo_t *cr, int val, double x, double y)
+{
+    GlyphAtlas *g = &c->glyphs;
+    int digits[12], n = 0, i, pos;
+    unsigned int mag = ABS (val);
+
+    if (val == LABEL_NONE)
+    {
+        digits[n++] = GLYPH_MINUS;
+        digits[n++] = GLYPH_MINUS;
+    }
+    else
+    {
+        do
+        {
+            digits[n++] = mag % 10;
+            mag /= 10;
+        } while (mag);
+        if (val < 0) digits[n++] = GLYPH_MINUS;
+    }
+
+    x = (int) x;
+    y = (int) y - g->ascent;
+    for (pos = n; pos < 3; pos++) x += g->advance;
+    for (i = n - 1; i >= 0; i--, x += g->advance) cairo_mask_surface (cr, g->glyph[digits[i]], x, y);
+    cairo_mask_surface (cr, g->glyph[GLYPH_DEGREE], x, y);
+    if (c->label_units == UNITS_FAHRENHEIT) cairo_mask_surface (cr, g->glyph[GLYPH_F], x + g->advance, y);
+}
+
+/* Update the border and text overlay; only redrawn when the displayed value changes. */
+static void redraw_overlay (CPUTempPlugin *c, gboolean full)
+{
+    int val = label_value (c);
+    if (!full && val == c->overlay_val) return;
+    c->overlay_val = val;
+
+    cairo_t *cr = cairo_create (c->overlay);
+    cairo_set_operator (cr, CAIRO_OPERATOR_CLEAR);
+    cairo_paint (cr);
+    cairo_set_operator (cr, CAIRO_OPERATOR_OVER);
+
+    /* draw a border in black */
+    cairo_set_source_rgb (cr, 0, 0, 0);
+    cairo_set_line_width (cr, 1);
+    cairo_move_to (cr, 0, 0);
+    cairo_line_to (cr, 0, c->pixmap_height);
+    cairo_line_to (cr, c->pixmap_width, c->pixmap_height);
+    cairo_line_to (cr, c->pixmap_width, 0);
+    cairo_line_to (cr, 0, 0);
+    cairo_stroke (cr);
+
+    /* No text until the sampler has produced a reading. */
+    if (c->start_time)
+    {
+        cairo_destroy (cr);
+        return;
+    }
+
+    int fontsize = 12;
+    if (c->pixmap_width > 50) fontsize = c->pixmap_height / 3;
+    if (fontsize != c->glyphs.fontsize) glyphs_render (&c->glyphs, fontsize);
+    draw_label (c, cr, val, (c->pixmap_width >> 1) - ((fontsize * 5) / 4), ((c->pixmap_height + fontsize) >> 1) - 1);
+
+    cairo_destroy (cr);
+}
+
+/* Redraw after new samples or resize. New bars have already been rasterised
+ * as they arrived, so the graph is only redrawn here if a full redraw has been
+ * requested by a resize or configuration change. */
+static void redraw_pixmap (CPUTempPlugin * c)
+{
+    gboolean full = c->redraw_full;
+    unsigned int cursor = graph_cursor (c);
+    unsigned int split = c->pixmap_width - cursor;
+
+    if (full) redraw_graph (c, TRUE);
+    redraw_overlay (c, full);
+    c->redraw_full = FALSE;
+    c->redraws++;
+
+    /* Composite the graph, oldest sample first, then the overlay. */
+    cairo_t *cr = cairo_create (c->pixmap);
+    cairo_set_operator (cr, CAIRO_OPERATOR_SOURCE);
+    cairo_set_source_surface (cr, c->graph, -(double) cursor, 0);
+    cairo_rectangle (cr, 0, 0, split, c->pixmap_height);
+    cairo_fill (cr);
+    if (cursor)
+    {
+        cairo_set_source_surface (cr, c->graph, split, 0);
+        cairo_rectangle (cr, split, 0, cursor, c->pixmap_height);
+        cairo_fill (cr);
+    }
+    cairo_set_operator (cr, CAIRO_OPERATOR_OVER);
+    cairo_set_source_surface (cr, c->overlay, 0, 0);
+    cairo_paint (cr);
+
+    /* check_cairo_status(cr); */
+    cairo_destroy(cr);
+
+    /* Have the drawing area repaint from the pixmap. */
+    gtk_widget_queue_draw (c->da);
+}
+
+/* Parse a throttle word, either bare or in "throttled=0x..." form */
+static gboolean parse_throttle (const char *str, guint *val)
+{
+    const char *pstr;
+    char *end;
+
+    if ((pstr = strchr (str, '='))) str = pstr + 1;
+    *val = strtoul (str, &end, 16);
+    return end != str;
+}
+
+/* Stand-in provider reading a plain file, for testing on non-Pi hosts */
+
+static gboolean file_throttle_open (ThrottleSource *t)
+{
+    return t->file.path && open_sensor (&t->file);
+}
+
+static gboolean file_throttle_read (ThrottleSource *t, guint *val)
+{
+    if (!read_sensor (&t->file, t->file.buf, sizeof (t->file.buf))) return FALSE;
+    return parse_throttle (t->file.buf, val);
+}
+
+/* Throttle status exported by the firmware driver in sysfs */
+
+static gboolean sysfs_throttle_open (ThrottleSource *t)
+{
+    t->file.path = g_build_filename (t->root, SYSFS_THROTTLE_FILE, NULL);
+    if (access (t->file.path, R_OK)) return FALSE;
+    return open_sensor (&t->file);
+}
+
+/* Throttle status queried from the firmware through the mailbox property interface */
+
+static gboolean mailbox_throttle_read (ThrottleSource *t, guint *val)
+{
+    guint32 msg[7] __attribute__ ((aligned (16)));
+
+    msg[0] = sizeof (msg);
+    msg[1] = 0;
+    msg[2] = MBOX_TAG_GET_THROTTLED;
+    msg[3] = sizeof (guint32);
+    msg[4] = 0;
+    msg[5] = 0;                             /* Don't clear the sticky bits */
+    msg[6] = 0;
+
+    if (ioctl (t->file.fd, IOCTL_MBOX_PROPERTY, msg) < 0) return FALSE;
+    if (msg[1] != MBOX_RESPONSE_SUCCESS) return FALSE;
+    *val = msg[5];
+    return TRUE;
+}
+
+static gboolean mailbox_throttle_open (ThrottleSource *t)
+{
+    guint val;
+
+    if (access (VCIO_DEVICE, R_OK | W_OK)) return FALSE;
+    t->file.path = g_strdup (VCIO_DEVICE);
+    t->file.fd = open (VCIO_DEVICE, O_RDWR | O_CLOEXEC);
+    if (t->file.fd < 0) return FALSE;
+    return mailbox_throttle_read (t, &val);
+}
+
+/* Last resort - run vcgencmd, at most once every VCGENCMD_INTERVAL */
+
+static char *get_string (char *cmd)
+{
+    char *line = NULL, *res = NULL;
+    size_t len = 0;
+    FILE *fp = popen (cmd, "r");
+
+    if (fp == NULL) return NULL;
+    if (getline (&line, &len, fp) > 0)
+    {
+        res = line;
+        while (*res)
+        {
+            if (g_ascii_isspace (*res)) *res = 0;
+            res++;
+        }
+        res = g_strdup (line);
+    }
+    pclose (fp);
+    g_free (line);
+    return res;
+}
+
+static gboolean vcgencmd_throttle_read (ThrottleSource *t, guint *val)
+{
+    gint64 now = g_get_monotonic_time ();
+    char *buf;
+
+    if (t->stamp && now - t->stamp < VCGENCMD_INTERVAL)
+    {
+        *val = t->value;
+        return TRUE;
+    }
+    t->stamp = now;
+
+    buf = get_string ("vcgencmd get_throttled");
+    if (!buf) return FALSE;
+    if (!parse_throttle (buf, &t->value)) t->value = 0;
+    g_free (buf);
+    *val = t->value;
+    return TRUE;
+}
+
+static gboolean vcgencmd_throttle_open (ThrottleSource *t)
+{
+    guint val;
+
+    return vcgencmd_throttle_read (t, &val);
+}
+
+static const ThrottleProvider file_throttle = { "file", file_throttle_open, file_throttle_read };
+static const ThrottleProvider sysfs_throttle = { "sysfs", sysfs_throttle_open, file_throttle_read };
+static const ThrottleProvider mailbox_throttle = { "mailbox", mailbox_throttle_open, mailbox_throttle_read };
+static const ThrottleProvider vcgencmd_throttle = { "vcgencmd", vcgencmd_throttle_open, vcgencmd_throttle_read };
+
+static void close_throttle (ThrottleSource *t)
+{
+    close_sensor (&t->file);
+    g_free (t->file.path);
+    t->file.path = NULL;
+    t->provider = NULL;
+    t->stamp = 0;
+}
+
+static gboolean try_throttle (ThrottleSource *t, const ThrottleProvider *provider)
+{
+    if (provider->open (t))
+    {
+        t->provider = provider;
+        g_message ("cputemp: Using %s throttle status", provider->name);
+        return TRUE;
+    }
+    close_throttle (t);
+    return FALSE;
+}
+
+static void check_throttle (CPUTempSampler *sm)
+{
+    ThrottleSource *t = &sm->throttle;
+
+    if (sm->throttle_file)
+    {
+        t->file.path = g_strdup (sm->throttle_file);
+        if (try_throttle (t, &file_throttle)) return;
+    }
+    if (!sm->ispi) return;
+
+    if (try_throttle (t, &sysfs_throttle)) return;
+    if (try_throttle (t, &mailbox_throttle)) return;
+    try_throttle (t, &vcgencmd_throttle);
+}
+
+static int get_throttle (CPUTempSampler *sm)
+{
+    ThrottleSource *t = &sm->throttle;
+    guint val;
+    gint64 start;
+    gboolean ok;
+
+    if (t->batched)
+    {
+        val = t->batched > 0 ? t->value : 0;
+        t->batched = 0;
+        return val;
+    }
+    if (!t->provider) return 0;
+    sm->stats.calls++;
+    start = g_get_monotonic_time ();
+    ok = t->provider->read (t, &val);
+    if (sm->instrument) hist_add (&sm->throttle_time, g_get_monotonic_time () - start);
+    return ok ? val : 0;
+}
+
+/* CPU frequency, read from each cpufreq policy through a persistent descriptor */
+
+static gint sysfs_parse_freq (const char *buf)
+{
+    gint val;
+
+    if (!parse_int (buf, &val)) return 0;
+    return val / 1000;
+}
+
+/* Find the cpufreq policies, and the highest frequency any of them can reach.
+ * Policies don't come and go while the system is running, so this is only
+ * done once. */
+static void find_cpufreq (CPUTempSampler *sm)
+{
+    GDir *dir;
+    const char *name;
+    char *path, *buf, *base = g_build_filename (sm->root, SYSFS_CPUFREQ_DIRECTORY, NULL);
+    CPUTempSensor *s;
+
+    if ((dir = g_dir_open (base, 0, NULL)))
+    {
+        while ((name = g_dir_read_name (dir)))
+        {
+            if (!g_str_has_prefix (name, SYSFS_CPUFREQ_PREFIX)) continue;
+            s = sensor_new (SENSOR_CPUFREQ, name, g_build_filename (base, name, SYSFS_CPUFREQ_CUR, NULL), NULL, sysfs_parse_freq);
+            if (!open_sensor (s))
+            {
+                sensor_free (s);
+                continue;
+            }
+            g_ptr_array_add (sm->cpufreq, s);
+
+            path = g_build_filename (base, name, SYSFS_CPUFREQ_MAX, NULL);
+            if (g_file_get_contents (path, &buf, NULL, NULL))
+            {
+                sm->freq_max = MAX (sm->freq_max, sysfs_parse_freq (buf));
+                g_free (buf);
+            }
+            g_free (path);
+        }
+        g_dir_close (dir);
+    }
+    g_free (base);
+    if (sm->cpufreq->len) g_message ("cputemp: Found %d cpufreq policies, up to %u MHz", sm->cpufreq->len, sm->freq_max);
+}
+
+/* Highest current frequency of any policy, in MHz */
+static guint get_freq (CPUTempSampler *sm)
+{
+    CPUTempSensor *s;
+    guint i, freq = 0;
+
+    for (i = 0; i < sm->cpufreq->len; i++)
+    {
+        s = g_ptr_array_index (sm->cpufreq, i);
+        sm->stats.calls++;
+        if (read_sensor (s, s->buf, sizeof (s->buf))) freq = MAX (freq, s->parse (s->buf));
+    }
+    return freq;
+}
+
+/* Open, lock and map the history file, creating or resetting it if it is not
+ * usable. Only one panel process at a time can hold the lock and write. */
+static HistoryFile *history_file_open (void)
+{
+    HistoryFile *hf = NULL;
+    CPUTempHistoryHeader *hdr;
+    size_t size = cputemp_history_size (CPUTEMP_HISTORY_CAPACITY);
+    struct stat st;
+    char *dir, *path;
+    int fd;
+
+    dir = g_build_filename (g_get_user_cache_dir (), "lxpanel", NULL);
+    path = g_build_filename (dir, CPUTEMP_HISTORY_FILE, NULL);
+    g_mkdir_with_parents (dir, 0700);
+
+    fd = open (path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd < 0)
+    {
+        g_warning ("cputemp: cannot open %s - %s", path, strerror (errno));
+        goto done;
+    }
+    if (flock (fd, LOCK_EX | LOCK_NB))
+    {
+        g_message ("cputemp: %s in use; history will not be saved", path);
+        close (fd);
+        goto done;
+    }
+    if (fstat (fd, &st) || (st.st_size != size && (ftruncate (fd, 0) || ftruncate (fd, size))))
+    {
+        g_warning ("cputemp: cannot size %s - %s", path, strerror (errno));
+        close (fd);
+        goto done;
+    }
+    hdr = mmap (NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (hdr == MAP_FAILED)
+    {
+        g_warning ("cputemp: cannot map %s - %s", path, strerror (errno));
+        close (fd);
+        goto done;
+    }
+
+    if (!cputemp_history_valid (hdr, size))
+    {
+        memset (hdr, 0, sizeof (CPUTempHistoryHeader));
+        memcpy (hdr->magic, CPUTEMP_HISTORY_MAGIC, sizeof (hdr->magic));
+        hdr->version = CPUTEMP_HISTORY_VERSION;
+        hdr->record_size = sizeof (CPUTempHistoryRecord);
+        hdr->capacity = CPUTEMP_HISTORY_CAPACITY;
+    }
+
+    hf = g_new0 (HistoryFile, 1);
+    hf->fd = fd;
+    hf->hdr = hdr;
+    hf->size = size;
+
+done:
+    g_free (path);
+    g_free (dir);
+    return hf;
+}
+
+static void history_file_close (HistoryFile *hf)
+{
+    if (!hf) return;
+    munmap (hf->hdr, hf->size);
+    close (hf->fd);
+    g_free (hf);
+}
+
+/* Store a sample in the mapping; the kernel writes it back in its own time. */
+static void history_file_append (HistoryFile *hf, gint64 time, gint temp, guint throttle)
+{
+    CPUTempHistoryHeader *hdr = hf->hdr;
+    CPUTempHistoryRecord *rec = (CPUTempHistoryRecord *) (hdr + 1) + hdr->head;
+
+    rec->time = time / G_USEC_PER_SEC;
+    rec->msec = (time / 1000) % 1000;
+    rec->temp = temp;
+    rec->throttle = throttle;
+
+    hdr->head = (hdr->head + 1) % hdr->capacity;
+    if (hdr->count < hdr->capacity) hdr->count++;
+}
+
+/* Create, lock and map the shared-memory segment. As with the history file,
+ * only one panel process at a time can publish. */
+static SharedSamples *shm_publish_open (void)
+{
+    SharedSamples *ss = g_new0 (SharedSamples, 1);
+    CPUTempShmHeader *hdr;
+    size_t size = cputemp_shm_size (CPUTEMP_SHM_CAPACITY);
+
+    cputemp_shm_name (ss->name, sizeof (ss->name));
+    ss->fd = shm_open (ss->name, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (ss->fd < 0)
+    {
+        g_warning ("cputemp: cannot open shared memory %s - %s", ss->name, strerror (errno));
+        g_free (ss);
+        return NULL;
+    }
+    if (flock (ss->fd, LOCK_EX | LOCK_NB))
+    {
+        g_message ("cputemp: Shared memory %s in use; samples will not be published", ss->name);
+        close (ss->fd);
+        g_free (ss);
+        return NULL;
+    }
+
+    /* Always start afresh, so that readers never see a previous run's samples. */
+    if (ftruncate (ss->fd, 0) || ftruncate (ss->fd, size))
+    {
+        g_warning ("cputemp: cannot size shared memory %s - %s", ss->name, strerror (errno));
+        goto fail;
+    }
+    hdr = mmap (NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, ss->fd, 0);
+    if (hdr == MAP_FAILED)
+    {
+        g_warning ("cputemp: cannot map shared memory %s - %s", ss->name, strerror (errno));
+        goto fail;
+    }
+
+    hdr->version = CPUTEMP_SHM_VERSION;
+    hdr->header_size = sizeof (CPUTempShmHeader);
+    hdr->slot_size = sizeof (CPUTempShmSlot);
+    hdr->capacity = CPUTEMP_SHM_CAPACITY;
+    hdr->sensors = CPUTEMP_SHM_SENSORS;
+    hdr->pid = getpid ();
+    cputemp_shm_fence ();
+    memcpy (hdr->magic, CPUTEMP_SHM_MAGIC, sizeof (hdr->magic));
+
+    ss->hdr = hdr;
+    ss->size = size;
+    ss->generation = G_MAXUINT;
+    ss->time_offset = g_get_real_time () - g_get_monotonic_time ();
+    return ss;
+
+fail:
+    shm_unlink (ss->name);
+    close (ss->fd);
+    g_free (ss);
+    return NULL;
+}
+
+static void shm_publish_close (SharedSamples *ss)
+{
+    if (!ss) return;
+    munmap (ss->hdr, ss->size);
+    shm_unlink (ss->name);
+    close (ss->fd);
+    g_free (ss);
+}
+
+/* Copy the sensor labels into the segment; run in the sampler thread, which
+ * is the only one to change the registry, so the registry needs no lock. */
+static void shm_publish_labels (CPUTempSampler *sm)
+{
+    CPUTempShmHeader *hdr = sm->shm->hdr;
+    CPUTempSensor *s;
+    guint i;
+
+    cputemp_shm_store (&hdr->label_seq, hdr->label_seq + 1);
+    cputemp_shm_fence ();
+    for (i = 0; i < CPUTEMP_SHM_SENSORS; i++)
+    {
+        s = i < sm->sensors->len ? g_ptr_array_index (sm->sensors, i) : NULL;
+        g_strlcpy (hdr->label[i], s ? s->label : "", CPUTEMP_SHM_LABEL);
+    }
+    cputemp_shm_store (&hdr->label_seq, hdr->label_seq + 1);
+    sm->shm->generation = sm->generation;
+}
+
+/* Store a sample in the next slot of the segment, then make it visible by
+ * advancing the sample count. */
+static void shm_publish (CPUTempSampler *sm, const CPUTempSample *smp)
+{
+    CPUTempShmHeader *hdr = sm->shm->hdr;
+    CPUTempShmSlot *slot = cputemp_shm_slot (hdr, hdr->count);
+    guint i, n = MIN (smp->numsensors, CPUTEMP_SHM_SENSORS);
+
+    if (sm->shm->generation != sm->generation) shm_publish_labels (sm);
+
+    cputemp_shm_store (&slot->seq, slot->seq + 1);
+    cputemp_shm_fence ();
+    slot->sample = hdr->count;
+    slot->time = smp->time + sm->shm->time_offset;
+    slot->temp = smp->temp;
+    slot->throttle = smp->throttle;
+    slot->numsensors = n;
+    for (i = 0; i < n; i++)
+        slot->temperature[i] = smp->temperature[i] == SENSOR_NONE ? CPUTEMP_SHM_NONE : smp->temperature[i];
+    cputemp_shm_store (&slot->seq, slot->seq + 1);
+    cputemp_shm_store (&hdr->count, hdr->count + 1);
+}
+
+static MetricsExport *metrics_new (const char *path, guint interval)
+{
+    MetricsExport *m = g_new0 (MetricsExport, 1);
+
+    m->path = g_strdup (path);
+    m->tmp = g_strdup_printf ("%s.tmp", path);
+    m->interval = MAX (interval, 1) * (gint64) G_USEC_PER_SEC;
+    m->max = G_MININT;
+    return m;
+}
+
+static void metrics_free (MetricsExport *m)
+{
+    if (!m) return;
+    g_free (m->path);
+    g_free (m->tmp);
+    g_free (m);
+}
+
+/* Write a label value, escaped as the exposition format requires */
+static void metrics_label (FILE *fp, const char *str)
+{
+    for (; *str; str++)
+    {
+        if (*str == '\\' || *str == '"') fputc ('\\', fp);
+        if (*str == '\n') fputs ("\\n", fp);
+        else fputc (*str, fp);
+    }
+}
+
+/* Write the latest sample to the metrics file, if the interval has passed
+ * since the last write. Run in the sampler thread, which owns the registry. */
+static void metrics_export (CPUTempSampler *sm, const CPUTempSample *smp)
+{
+    static const char *conditions[] = { "under_voltage", "freq_capped", "throttled", "soft_temp_limit" };
+    MetricsExport *m = sm->metrics;
+    CPUTempSensor *s;
+    gint64 now = g_get_monotonic_time ();
+    char buf[G_ASCII_DTOSTR_BUF_SIZE];
+    FILE *fp;
+    int i;
+
+    if (smp->temp != COMBINED_NONE && smp->temp > m->max) m->max = smp->temp;
+    if (m->last && now - m->last < m->interval) return;
+    m->last = now;
+
+    if (!(fp = fopen (m->tmp, "w")))
+    {
+        if (!m->failed) g_warning ("cputemp: cannot write metrics to %s - %s", m->tmp, strerror (errno));
+        m->failed = TRUE;
+        return;
+    }
+
+    /* The combined readings are left out while no sensor is combined, rather
+     * than given as absolute zero */
+    if (smp->temp != COMBINED_NONE)
+    {
+        fprintf (fp, "# HELP cputemp_celsius CPU temperature, combined from the sensors by the policy of the first panel instance.\n");
+        fprintf (fp, "# TYPE cputemp_celsius gauge\ncputemp_celsius %s\n", format_degrees (buf, smp->temp));
+    }
+    if (m->max != G_MININT)
+    {
+        fprintf (fp, "# HELP cputemp_max_since_last_write_celsius Highest combined CPU temperature since the previous write of this file.\n");
+        fprintf (fp, "# TYPE cputemp_max_since_last_write_celsius gauge\ncputemp_max_since_last_write_celsius %s\n", format_degrees (buf, m->max));
+    }
+    fprintf (fp, "# HELP cputemp_sensor_celsius Reading of each temperature sensor.\n# TYPE cputemp_sensor_celsius gauge\n");
+    for (i = 0; i < smp->numsensors && i < sm->sensors->len; i++)
+    {
+        if (!(s = g_ptr_array_index (sm->sensors, i)) || smp->temperature[i] == SENSOR_NONE) continue;
+        fputs ("cputemp_sensor_celsius{sensor=\"", fp);
+        metrics_label (fp, s->name);
+        fputs ("\",label=\"", fp);
+        metrics_label (fp, s->label);
+        fprintf (fp, "\"} %s\n", format_degrees (buf, smp->temperature[i]));
+    }
+    if (sm->throttle.provider)
+    {
+        fprintf (fp, "# HELP cputemp_throttle_status Firmware throttle status word.\n");
+        fprintf (fp, "# TYPE cputemp_throttle_status gauge\ncputemp_throttle_status %u\n", smp->throttle);
+        fprintf (fp, "# HELP cputemp_throttle_condition Whether each throttle condition holds now, or has since boot.\n");
+        fprintf (fp, "# TYPE cputemp_throttle_condition gauge\n");
+        for (i = 0; i < G_N_ELEMENTS (conditions); i++)
+        {
+            fprintf (fp, "cputemp_throttle_condition{condition=\"%s\",when=\"now\"} %u\n", conditions[i], (smp->throttle >> i) & 1);
+            fprintf (fp, "cputemp_throttle_condition{condition=\"%s\",when=\"since_boot\"} %u\n", conditions[i], (smp->throttle >> (i + 16)) & 1);
+        }
+    }
+    if (smp->freq)
+    {
+        fprintf (fp, "# HELP cputemp_cpu_frequency_hertz Highest current frequency of any CPU.\n");
+        fprintf (fp, "# TYPE cputemp_cpu_frequency_hertz gauge\ncputemp_cpu_frequency_hertz %u000000\n", smp->freq);
+    }
+    fprintf (fp, "# HELP cputemp_sample_timestamp_seconds Time the sample was taken.\n");
+    fprintf (fp, "# TYPE cputemp_sample_timestamp_seconds gauge\ncputemp_sample_timestamp_seconds %.3f\n",
+        g_get_real_time () / (double) G_USEC_PER_SEC);
+
+    if (fclose (fp) || rename (m->tmp, m->path))
+    {
+        if (!m->failed) g_warning ("cputemp: cannot write metrics to %s - %s", m->path, strerror (errno));
+        m->failed = TRUE;
+        unlink (m->tmp);
+        return;
+    }
+    m->failed = FALSE;
+    m->max = G_MININT;
+}
+
+static void sampler_log_stats (CPUTempSampler *sm)
+{
+    ReadStats *st = &sm->stats;
+
+    if (st->samples)
+        g_message ("cputemp: %s reads: %u samples, %.0f us and %.1f system calls per sample", backend_names[sm->active_backend],
+            st->samples, (double) st->time / st->samples, (double) st->calls / st->samples);
+    memset (st, 0, sizeof (*st));
+}
+
+#ifdef HAVE_LINUX_IO_URING_H
+
+/* Batched reads through io_uring, using the raw system calls so as not to
+ * need liburing. Every sensor file (and the throttle file, if there is one)
+ * is registered with the ring, and on each sample all the reads are queued
+ * and submitted with a single io_uring_enter call, which also waits for them. */
+
+static int uring_setup (unsigned entries, struct io_uring_params *p)
+{
+    return syscall (__NR_io_uring_setup, entries, p);
+}
+
+static int uring_enter (int fd, unsigned submit, unsigned complete, unsigned flags)
+{
+    return syscall (__NR_io_uring_enter, fd, submit, complete, flags, NULL, 0);
+}
+
+static int uring_register (int fd, unsigned opcode, void *arg, unsigned nargs)
+{
+    return syscall (__NR_io_uring_register, fd, opcode, arg, nargs);
+}
+
+static void uring_free (IoRing *r)
+{
+    if (!r) return;
+    if (r->sqes) munmap (r->sqes, r->sqes_len);
+    if (r->cq_ptr && r->cq_ptr != r->sq_ptr) munmap (r->cq_ptr, r->cq_len);
+    if (r->sq_ptr) munmap (r->sq_ptr, r->sq_len);
+    if (r->fd >= 0) close (r->fd);
+    g_free (r->files);
+    g_free (r);
+}
+
+static void *uring_map (int fd, size_t len, off_t offset)
+{
+    void *ptr = mmap (NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, offset);
+    return ptr == MAP_FAILED ? NULL : ptr;
+}
+
+static IoRing *uring_new (void)
+{
+    struct io_uring_params p;
+    IoRing *r = g_new0 (IoRing, 1);
+    char *sq, *cq;
+
+    memset (&p, 0, sizeof (p));
+    if ((r->fd = uring_setup (URING_ENTRIES, &p)) < 0)
+    {
+        g_message ("cputemp: io_uring not available - %s", strerror (errno));
+        uring_free (r);
+        return NULL;
+    }
+
+    r->entries = p.sq_entries;
+    r->sq_len = p.sq_off.array + p.sq_entries * sizeof (unsigned);
+    r->cq_len = p.cq_off.cqes + p.cq_entries * sizeof (struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) r->sq_len = r->cq_len = MAX (r->sq_len, r->cq_len);
+    r->sqes_len = p.sq_entries * sizeof (struct io_uring_sqe);
+
+    r->sq_ptr = uring_map (r->fd, r->sq_len, IORING_OFF_SQ_RING);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) r->cq_ptr = r->sq_ptr;
+    else r->cq_ptr = uring_map (r->fd, r->cq_len, IORING_OFF_CQ_RING);
+    r->sqes = uring_map (r->fd, r->sqes_len, IORING_OFF_SQES);
+    if (!r->sq_ptr || !r->cq_ptr || !r->sqes)
+    {
+        g_message ("cputemp: cannot map io_uring - %s", strerror (errno));
+        uring_free (r);
+        return NULL;
+    }
+
+    sq = r->sq_ptr;
+    cq = r->cq_ptr;
+    r->sq_tail = (unsigned *) (sq + p.sq_off.tail);
+    r->sq_mask = (unsigned *) (sq + p.sq_off.ring_mask);
+    r->sq_array = (unsigned *) (sq + p.sq_off.array);
+    r->cq_head = (unsigned *) (cq + p.cq_off.head);
+    r->cq_tail = (unsigned *) (cq + p.cq_off.tail);
+    r->cq_mask = (unsigned *) (cq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+    return r;
+}
+
+/* Register the current sensor and throttle descriptors with the ring, if
+ * they have changed since they were last registered. Sensor i uses table
+ * entry i; the throttle file uses the entry after the last sensor. */
+static gboolean uring_register_files (CPUTempSampler *sm, IoRing *r)
+{
+    CPUTempSensor *s;
+    guint i, n = sm->sensors->len + 1;
+    gboolean changed = n != r->nfiles;
+
+    if (changed)
+    {
+        r->files = g_renew (int, r->files, n);
+        r->nfiles = n;
+    }
+    for (i = 0; i < n; i++)
+    {
+        s = i < sm->sensors->len ? g_ptr_array_index (sm->sensors, i) : &sm->throttle.file;
+        if (s && r->files[i] != s->fd) changed = TRUE;
+        if (!s && r->files[i] != -1) changed = TRUE;
+        r->files[i] = s ? s->fd : -1;
+        if (s) s->index = i;
+    }
+    if (!changed && r->registered) return TRUE;
+
+    if (r->registered) uring_register (r->fd, IORING_UNREGISTER_FILES, NULL, 0);
+    r->registered = uring_register (r->fd, IORING_REGISTER_FILES, r->files, n) == 0;
+    sm->stats.calls += 2;
+    if (!r->registered) g_message ("cputemp: cannot register sensors with io_uring - %s", strerror (errno));
+    return r->registered;
+}
+
+/* Submit reads of a batch of files and wait for them all. Returns the index
+ * of the last read to complete, -1 if the batch could not be run, or -2 if
+ * the kernel doesn't support reads through io_uring. */
+static int uring_read_batch (IoRing *r, CPUTempSensor **batch, gboolean *ok, guint n)
+{
+    struct io_uring_sqe *sqe;
+    struct io_uring_cqe *cqe;
+    unsigned tail = *r->sq_tail, head, idx;
+    gboolean unsupported = FALSE;
+    int last = -1;
+    guint i;
+
+    for (i = 0; i < n; i++)
+    {
+        idx = tail & *r->sq_mask;
+        sqe = &r->sqes[idx];
+        memset (sqe, 0, sizeof (*sqe));
+        sqe->opcode = IORING_OP_READ;
+        sqe->flags = IOSQE_FIXED_FILE;
+        sqe->fd = batch[i]->index;
+        sqe->addr = (uintptr_t) batch[i]->buf;
+        sqe->len = sizeof (batch[i]->buf) - 1;
+        sqe->off = 0;
+        sqe->user_data = i;
+        r->sq_array[idx] = idx;
+        ok[i] = FALSE;
+        tail++;
+    }
+    __atomic_store_n (r->sq_tail, tail, __ATOMIC_RELEASE);
+
+    if (uring_enter (r->fd, n, n, IORING_ENTER_GETEVENTS) < 0)
+    {
+        g_message ("cputemp: io_uring_enter failed - %s", strerror (errno));
+        return -1;
+    }
+
+    head = *r->cq_head;
+    while (head != __atomic_load_n (r->cq_tail, __ATOMIC_ACQUIRE))
+    {
+        cqe = &r->cqes[head & *r->cq_mask];
+        i = cqe->user_data;
+        if (i < n)
+        {
+            if (cqe->res > 0)
+            {
+                batch[i]->buf[cqe->res] = '\0';
+                ok[i] = TRUE;
+            }
+            else if (cqe->res == -EINVAL) unsupported = TRUE;
+            last = i;
+        }
+        head++;
+    }
+    __atomic_store_n (r->cq_head, head, __ATOMIC_RELEASE);
+    return unsupported ? -2 : last;
+}
+
+/* Read all sensors due this sample, and the throttle file if there is one,
+ * through the ring. Sensors whose read fails are left for the synchronous
+ * path, which also takes care of reopening them. When a batch is slow, the
+ * sensor which finished last is taken to be the cause and backed off. */
+static gboolean uring_read_sensors (CPUTempSampler *sm)
+{
+    IoRing *r = sm->ring;
+    CPUTempSensor *batch[URING_ENTRIES], *s;
+    gboolean ok[URING_ENTRIES];
+    ThrottleSource *t = &sm->throttle;
+    guint i = 0, n, k;
+    gint64 start;
+    int last;
+
+    if (!uring_register_files (sm, r)) return FALSE;
+
+    while (i <= sm->sensors->len)
+    {
+        for (n = 0; i <= sm->sensors->len && n < r->entries && n < URING_ENTRIES; i++)
+        {
+            if (i < sm->sensors->len)
+            {
+                s = g_ptr_array_index (sm->sensors, i);
+                if (!s || !sensor_due (sm, s) || s->skip || s->fd < 0) continue;
+            }
+            else
+            {
+                /* Only file-backed throttle providers can be batched */
+                s = &t->file;
+                if (!t->provider || t->provider->read != file_throttle_read || s->fd < 0) continue;
+            }
+            batch[n++] = s;
+        }
+        if (!n) break;
+
+        start = g_get_monotonic_time ();
+        last = uring_read_batch (r, batch, ok, n);
+        sm->stats.calls++;
+        if (sm->instrument) hist_add (&sm->batch_time, g_get_monotonic_time () - start);
+        if (last == -2)
+        {
+            g_message ("cputemp: io_uring reads not supported by this kernel");
+            return FALSE;
+        }
+        if (last < 0) return FALSE;
+
+        for (k = 0; k < n; k++)
+        {
+            if (!ok[k]) continue;
+            s = batch[k];
+            if (s == &t->file)
+            {
+                t->batched = parse_throttle (s->buf, &t->value) ? 1 : -1;
+                continue;
+            }
+            s->value = s->parse (s->buf);
+            s->batched = TRUE;
+        }
+        if (g_get_monotonic_time () - start > SENSOR_TIMEOUT && batch[last] != &t->file)
+        {
+            s = batch[last];
+            s->backoff = s->backoff ? MIN (s->backoff * 2, SENSOR_MAX_BACKOFF) : 1;
+            s->skip = s->backoff;
+            g_message ("cputemp: Sensor %s is slow; skipping %u samples", s->path, s->skip);
+        }
+    }
+    return TRUE;
+}
+
+#endif
+
+/* Switch between synchronous and batched reads to match the setting. */
+static gboolean sampler_update_backend (CPUTempSampler *sm)
+{
+    gint backend = g_atomic_int_get (&sm->backend);
+
+    sampler_log_stats (sm);
+#ifdef HAVE_LINUX_IO_URING_H
+    if (backend == BACKEND_URING && !sm->ring)
+    {
+        if (!(sm->ring = uring_new ())) backend = BACKEND_PREAD;
+    }
+    else if (backend != BACKEND_URING && sm->ring)
+    {
+        uring_free (sm->ring);
+        sm->ring = NULL;
+    }
+#else
+    if (backend == BACKEND_URING) g_message ("cputemp: Built without io_uring support");
+    backend = BACKEND_PREAD;
+#endif
+    sm->active_backend = backend;
+    return FALSE;
+}
+
+/* Read the sensors due this sample into the sample. Each instance gets the
+ * readings combined by its own policy when the sample is delivered; the
+ * reading returned, which the sampler itself saves, publishes and paces its
+ * sampling by, is combined by the policy of the longest-running instance.
+ * Sensors which no instance combines are read less often, and those no
+ * instance selects not at all; in between reads, a
+ * sensor reports its last reading. A sensor whose read takes longer than
+ * SENSOR_TIMEOUT is skipped for an increasing number of reads, so that a
+ * stalled bus only delays the sampler occasionally rather than on every sample. */
+static gint get_temperature (CPUTempSampler *sm, CPUTempSample *smp)
+{
+    CPUTempSensor *s;
+    gint64 start;
+    gint temp, i;
+
+    sm->tick++;
+    smp->numsensors = sm->sensors->len;
+    smp->generation = sm->generation;
+    if (smp->size < smp->numsensors)
+    {
+        sm->alloc_bytes += (smp->numsensors - smp->size) * sizeof (gint);
+        smp->size = smp->numsensors;
+        smp->temperature = g_renew (gint, smp->temperature, smp->size);
+    }
+
+#ifdef HAVE_LINUX_IO_URING_H
+    if (sm->ring && !uring_read_sensors (sm))
+    {
+        g_message ("cputemp: Falling back to %s reads", backend_names[BACKEND_PREAD]);
+        sampler_log_stats (sm);
+        uring_free (sm->ring);
+        sm->ring = NULL;
+        sm->active_backend = BACKEND_PREAD;
+    }
+#endif
+
+    for (i = 0; i < smp->numsensors; i++)
+    {
+        if (!(s = g_ptr_array_index (sm->sensors, i)) || s->role == ROLE_UNUSED)
+        {
+            smp->temperature[i] = SENSOR_NONE;
+            continue;
+        }
+        /* Between reads, a secondary sensor keeps its last reading */
+        if (!sensor_due (sm, s))
+        {
+            smp->temperature[i] = s->value;
+            continue;
+        }
+        if (s->skip) s->skip--;
+        else if (s->batched) s->batched = FALSE;
+        else
+        {
+            sm->stats.calls++;
+            start = g_get_monotonic_time ();
+            s->value = sensor_read_temperature (s);
+            start = g_get_monotonic_time () - start;
+            if (sm->instrument) hist_add (&s->read_time, start);
+            if (start > SENSOR_TIMEOUT)
+            {
+                s->backoff = s->backoff ? MIN (s->backoff * 2, SENSOR_MAX_BACKOFF) : 1;
+                s->skip = s->backoff;
+                g_message ("cputemp: Sensor %s is slow; skipping %u samples", s->path, s->skip);
+            }
+            else s->backoff = 0;
+        }
+        smp->temperature[i] = s->value;
+    }
+
+    g_mutex_lock (&sm->lock);
+    temp = sm->clients->len ? combine_readings (g_ptr_array_index (sm->clients, 0), smp) : COMBINED_NONE;
+    g_mutex_unlock (&sm->lock);
+    return temp;
+}
+
+/* Slot for the sampler to fill with the next sample, or NULL if the queue is full */
+static CPUTempSample *queue_reserve (SampleQueue *q)
+{
+    if (q->head - g_atomic_int_get (&q->tail) >= SAMPLE_QUEUE_SIZE) return NULL;
+    return &q->slot[q->head & (SAMPLE_QUEUE_SIZE - 1)];
+}
+
+static void queue_push (SampleQueue *q)
+{
+    g_atomic_int_set (&q->head, q->head + 1);
+}
+
+/* Oldest sample for the main thread to read, or NULL if the queue is empty */
+static CPUTempSample *queue_peek (SampleQueue *q)
+{
+    if (q->tail == g_atomic_int_get (&q->head)) return NULL;
+    return &q->slot[q->tail & (SAMPLE_QUEUE_SIZE - 1)];
+}
+
+static void queue_pop (SampleQueue *q)
+{
+    g_atomic_int_set (&q->tail, q->tail + 1);
+}
+
+/* Copy a sample into a free queue slot, keeping the slot's own readings */
+static void sample_copy (CPUTempSampler *sm, CPUTempSample *dst, const CPUTempSample *src)
+{
+    gint *temperature = dst->temperature;
+    gint size = dst->size;
+
+    if (size < src->numsensors)
+    {
+        sm->alloc_bytes += (src->numsensors - size) * sizeof (gint);
+        size = src->numsensors;
+        temperature = g_renew (gint, temperature, size);
+    }
+    *dst = *src;
+    dst->temperature = temperature;
+    dst->size = size;
+    if (src->numsensors) memcpy (temperature, src->temperature, src->numsensors * sizeof (gint));
+}
+
+/* Hand a sample to every instance, with the readings combined by its own
+ * policy; a replayed trace keeps the combined readings recorded in it. An
+ * instance whose queue is full has fallen behind, and loses the sample rather
+ * than holding up the others. */
+static void sampler_deliver (CPUTempSampler *sm, const CPUTempSample *smp)
+{
+    SampleClient *cl;
+    CPUTempSample *slot;
+    guint64 one = 1;
+    guint i;
+
+    g_mutex_lock (&sm->lock);
+    for (i = 0; i < sm->clients->len; i++)
+    {
+        cl = g_ptr_array_index (sm->clients, i);
+        if (!(slot = queue_reserve (&cl->queue)))
+        {
+            sm->dropped++;
+            continue;
+        }
+        sample_copy (sm, slot, smp);
+        if (!sm->replay) slot->temp = combine_readings (cl, smp);
+        queue_push (&cl->queue);
+        if (write (cl->event_fd, &one, sizeof (one)) < 0 && errno != EAGAIN)
+            g_warning ("cputemp: cannot signal sample - %s", strerror (errno));
+    }
+    g_mutex_unlock (&sm->lock);
+}
+
+/* Whether every instance has room for another sample */
+static gboolean sampler_can_deliver (CPUTempSampler *sm)
+{
+    gboolean room = TRUE;
+    guint i;
+
+    g_mutex_lock (&sm->lock);
+    for (i = 0; i < sm->clients->len; i++)
+        if (!queue_reserve (&((SampleClient *) g_ptr_array_index (sm->clients, i))->queue)) room = FALSE;
+    g_mutex_unlock (&sm->lock);
+    return room;
+}
+
+static gboolean sampler_update (CPUTempSampler *sm);
+
+/* Arm the timer for the next sample. Whole-second intervals use a seconds
+ * timeout so that the wakeup can be coalesced with others in the system. */
+static void sampler_schedule (CPUTempSampler *sm)
+{
+    GSource *source;
+
+    if (sm->interval % 1000) source = g_timeout_source_new (sm->interval);
+    else source = g_timeout_source_new_seconds (sm->interval / 1000);
+    g_source_set_callback (source, (GSourceFunc) sampler_update, sm, NULL);
+    sm->timer = g_source_attach (source, sm->context);
+    g_source_unref (source);
+    sm->due = g_get_monotonic_time () + sm->interval * 1000;
+}
+
+/* Pick the time to the next sample. Sample quickly while the temperature is
+ * moving or the SoC is being throttled, and back off in steps while it is
+ * stable. While the graph is hidden, only enough samples are taken to keep the
+ * history, whatever the temperature is doing. */
+static void sampler_adapt (CPUTempSampler *sm, const CPUTempSample *smp)
+{
+    if (ABS (smp->temp - sm->last_temp) >= SAMPLE_ACTIVE_DELTA || (smp->throttle & THROTTLE_CURRENT))
+        sm->stable = 0;
+    else sm->stable++;
+    sm->last_temp = smp->temp;
+
+    if (g_atomic_int_get (&sm->hidden)) sm->interval = SAMPLE_INTERVAL_HIDDEN;
+    else if (sm->stable >= 2 * SAMPLE_STABLE_COUNT) sm->interval = SAMPLE_INTERVAL_SLOW;
+    else if (sm->stable >= SAMPLE_STABLE_COUNT) sm->interval = SAMPLE_INTERVAL_IDLE;
+    else sm->interval = SAMPLE_INTERVAL;
+}
+
+/* Sampler timer callback, run in the sampler thread. */
+static gboolean sampler_update (CPUTempSampler *sm)
+{
+    CPUTempSample *smp = &sm->current;
+
+    sm->timer = 0;
+    sm->wakeups++;
+
+    smp->time = g_get_monotonic_time ();
+
+    /* Seconds timeouts may be coalesced up to a second late, so only
+     * lateness beyond that counts as a missed sample. */
+    if (sm->instrument && sm->due)
+    {
+        hist_add (&sm->late, MAX (smp->time - sm->due, 0));
+        if (smp->time - sm->due >= sm->interval * 1000 + (sm->interval % 1000 ? 0 : G_USEC_PER_SEC)) sm->missed++;
+    }
+    smp->temp = get_temperature (sm, smp);
+    smp->throttle = get_throttle (sm);
+    smp->freq = get_freq (sm);
+    smp->freq_max = sm->freq_max;
+    sm->stats.time += g_get_monotonic_time () - smp->time;
+    sm->stats.samples++;
+
+    sampler_adapt (sm, smp);
+    sampler_schedule (sm);
+
+    /* The lock keeps an instance starting up from reloading a half-written
+     * record. A sample with no sensor combined is left out, as it would
+     * reload as a reading of absolute zero. */
+    if (sm->history && smp->temp != COMBINED_NONE)
+    {
+        g_mutex_lock (&sm->lock);
+        history_file_append (sm->history, g_get_real_time (), smp->temp, smp->throttle);
+        g_mutex_unlock (&sm->lock);
+    }
+    if (sm->shm) shm_publish (sm, smp);
+    if (sm->metrics) metrics_export (sm, smp);
+
+    sampler_deliver (sm, smp);
+    return FALSE;
+}
+
+/* Trace replay, run in the sampler thread in place of sampling the sensors */
+
+/* Set the label of a sensor slot from a trace. The slot gets a placeholder
+ * sensor, so that the main thread sees labels just as it would for real ones. */
+static void replay_sensor (CPUTempSampler *sm, const char *line)
+{
+    CPUTempSensor *s;
+    char *end, *label;
+    guint i = strtoul (line, &end, 10);
+
+    if (end == line || *end != ' ' || i >= TRACE_MAX_SENSORS) return;
+    label = g_strstrip (g_strdup (end + 1));
+
+    g_mutex_lock (&sm->lock);
+    if (i >= sm->sensors->len) g_ptr_array_set_size (sm->sensors, i + 1);
+    if ((s = g_ptr_array_index (sm->sensors, i)))
+    {
+        sensor_free (s);
+        sm->active--;
+    }
+    s = sensor_new (SENSOR_TRACE, label, g_strdup (sm->replay->path), label, NULL);
+    s->id = ++sm->next_id;
+    g_ptr_array_index (sm->sensors, i) = s;
+    sm->active++;
+    sm->generation++;
+    g_mutex_unlock (&sm->lock);
+}
+
+/* Read up to the next sample line, applying any sensor labels on the way */
+static gboolean replay_next (CPUTempSampler *sm)
+{
+    TraceReplay *r = sm->replay;
+
+    while (getline (&r->line, &r->len, r->fp) > 0)
+    {
+        if (g_str_has_prefix (r->line, TRACE_SENSOR)) replay_sensor (sm, r->line + strlen (TRACE_SENSOR));
+        else if (r->line[0] != '#' && r->line[0] != '\n') return TRUE;
+    }
+    return FALSE;
+}
+
+static gboolean replay_parse (CPUTempSampler *sm, const char *line, CPUTempSample *smp)
+{
+    char *end, *next;
+    gint64 time;
+    guint n, i;
+
+    time = g_ascii_strtoll (line, &end, 10);
+    if (end == line) return FALSE;
+    smp->throttle = strtoul (end, &end, 16);
+    smp->temp = parse_degrees (end, &end);
+    n = strtoul (end, &end, 10);
+    if (n > TRACE_MAX_SENSORS) return FALSE;
+
+    if (smp->size < n)
+    {
+        sm->alloc_bytes += (n - smp->size) * sizeof (gint);
+        smp->size = n;
+        smp->temperature = g_renew (gint, smp->temperature, n);
+    }
+    for (i = 0; i < n; i++)
+    {
+        /* A lone '-' is a missing reading; one followed by digits is below zero */
+        while (*end == ' ') end++;
+        if (end[0] == '-' && (!end[1] || g_ascii_isspace (end[1])))
+        {
+            smp->temperature[i] = SENSOR_NONE;
+            end++;
+            continue;
+        }
+        smp->temperature[i] = parse_degrees (end, &next);
+        if (next == end) return FALSE;
+        end = next;
+    }
+
+    smp->time = sm->replay->start + time;
+    smp->freq = 0;
+    smp->freq_max = 0;
+    smp->numsensors = n;
+    smp->generation = sm->generation;
+    return TRUE;
+}
+
+static gboolean replay_update (CPUTempSampler *sm);
+
+static void replay_schedule (CPUTempSampler *sm, guint delay)
+{
+    GSource *source = g_timeout_source_new (delay);
+    g_source_set_callback (source, (GSourceFunc) replay_update, sm, NULL);
+    g_source_attach (source, sm->context);
+    g_source_unref (source);
+}
+
+/* Replay timer callback. Samples keep their times from the trace, so the
+ * graph and history see the trace's own pace however fast it is played. */
+static gboolean replay_update (CPUTempSampler *sm)
+{
+    TraceReplay *r = sm->replay;
+    CPUTempSample *smp = &sm->current;
+    gint64 due;
+
+    /* Wait for every instance rather than drop samples, so the whole trace is seen. */
+    if (!sampler_can_deliver (sm))
+    {
+        replay_schedule (sm, TRACE_RETRY);
+        return FALSE;
+    }
+
+    if (replay_parse (sm, r->line, smp))
+    {
+        if (sm->shm) shm_publish (sm, smp);
+        if (sm->metrics) metrics_export (sm, smp);
+        sampler_deliver (sm, smp);
+        r->samples++;
+    }
+    else g_warning ("cputemp: Bad sample in trace %s", r->path);
+
+    if (!replay_next (sm))
+    {
+        g_message ("cputemp: Replayed %u samples from %s", r->samples, r->path);
+        return FALSE;
+    }
+    due = r->start + g_ascii_strtoll (r->line, NULL, 10) / r->speed;
+    replay_schedule (sm, MAX (due - g_get_monotonic_time (), 0) / 1000);
+    return FALSE;
+}
+
+static void replay_start (CPUTempSampler *sm)
+{
+    sm->replay->start = g_get_monotonic_time ();
+    if (replay_next (sm)) replay_update (sm);
+    else g_message ("cputemp: Trace %s holds no samples", sm->replay->path);
+}
+
+/* Replay a trace in place of sampling the sensors; called before the sampler starts */
+static gboolean sampler_replay (CPUTempSampler *sm, const char *path, guint speed)
+{
+    TraceReplay *r;
+    FILE *fp;
+    char *line = NULL;
+    size_t len = 0;
+
+    if (!(fp = fopen (path, "r")))
+    {
+        g_warning ("cputemp: cannot open trace %s - %s", path, strerror (errno));
+        return FALSE;
+    }
+    if (getline (&line, &len, fp) <= 0 || strncmp (line, TRACE_MAGIC, strlen (TRACE_MAGIC)))
+    {
+        g_warning ("cputemp: %s is not a temperature trace", path);
+        free (line);
+        fclose (fp);
+        return FALSE;
+    }
+
+    r = g_new0 (TraceReplay, 1);
+    r->path = g_strdup (path);
+    r->fp = fp;
+    r->line = line;
+    r->len = len;
+    r->speed = CLAMP (speed, 1, REPLAY_MAX_SPEED);
+    sm->replay = r;
+    g_message ("cputemp: Replaying %s at %ux", path, r->speed);
+    return TRUE;
+}
+
+static void replay_free (TraceReplay *r)
+{
+    if (!r) return;
+    fclose (r->fp);
+    free (r->line);
+    g_free (r->path);
+    g_free (r);
+}
+
+static gboolean sampler_quit (CPUTempSampler *sm)
+{
+    g_main_loop_quit (sm->loop);
+    return FALSE;
+}
+
+/* Open or close the history file to match the requested setting. */
+static gboolean sampler_update_history (CPUTempSampler *sm)
+{
+    HistoryFile *hf = sm->history;
+
+    /* Instances starting up read the history file with the lock held */
+    if (g_atomic_int_get (&sm->save_history))
+    {
+        if (!hf) hf = history_file_open ();
+    }
+    else hf = NULL;
+    g_mutex_lock (&sm->lock);
+    if (hf != sm->history) history_file_close (sm->history);
+    sm->history = hf;
+    g_mutex_unlock (&sm->lock);
+    return FALSE;
+}
+
+/* Run a function from inside the sampler's own loop. Unlike
+ * g_main_context_invoke, this can't run the function in the calling
+ * thread while the sampler thread is still taking its first sample. */
+static void sampler_invoke (CPUTempSampler *sm, GSourceFunc func)
+{
+    GSource *source = g_idle_source_new ();
+    g_source_set_callback (source, func, sm, NULL);
+    g_source_attach (source, sm->context);
+    g_source_unref (source);
+}
+
+/* Keep history while any instance wants it. Clients are only added and
+ * removed in the main thread, so the list can be read here without the lock.
+ * Before the sampler thread starts, the history file is opened straight away,
+ * so that the first instance can reload it. */
+static void sampler_update_wanted (CPUTempSampler *sm)
+{
+    gboolean save = FALSE;
+    guint i;
+
+    for (i = 0; i < sm->clients->len; i++)
+        if (((SampleClient *) g_ptr_array_index (sm->clients, i))->save_history) save = TRUE;
+
+    if (save == g_atomic_int_get (&sm->save_history)) return;
+    g_atomic_int_set (&sm->save_history, save);
+    if (sm->thread) sampler_invoke (sm, (GSourceFunc) sampler_update_history);
+    else sampler_update_history (sm);
+}
+
+static void sampler_set_history (CPUTempSampler *sm, SampleClient *cl, gboolean save)
+{
+    cl->save_history = save;
+    sampler_update_wanted (sm);
+}
+
+static void sampler_set_backend (CPUTempSampler *sm, ReadBackend backend)
+{
+    if (g_atomic_int_get (&sm->backend) == backend) return;
+    g_atomic_int_set (&sm->backend, backend);
+    sampler_invoke (sm, (GSourceFunc) sampler_update_backend);
+}
+
+/* Merge the instances' use of the sensors again, after one of them has
+ * started, stopped or changed its policy. Only the sampler thread, which
+ * reads the sensors, sets their roles once it is running. */
+static gboolean sampler_update_roles (CPUTempSampler *sm)
+{
+    g_mutex_lock (&sm->lock);
+    merge_roles (sm);
+    g_mutex_unlock (&sm->lock);
+    return FALSE;
+}
+
+static void sampler_update_policy (CPUTempSampler *sm)
+{
+    if (sm->thread) sampler_invoke (sm, (GSourceFunc) sampler_update_roles);
+    else sampler_update_roles (sm);
+}
+
+/* Change the policy and selection an instance combines the readings by. The
+ * instance's samples are combined by the new policy straight away; the
+ * sensors read change to match once the sampler thread has merged it. */
+static void sampler_set_policy (CPUTempSampler *sm, SampleClient *cl, SensorPolicy policy, const char *selection)
+{
+    g_mutex_lock (&sm->lock);
+    cl->policy = policy;
+    g_free (cl->selection);
+    cl->selection = g_strdup (selection);
+    client_apply_policy (sm, cl);
+    g_mutex_unlock (&sm->lock);
+    sampler_update_policy (sm);
+}
+
+/* Take a sample now in place of the one scheduled, and go back to sampling
+ * at full rate, as the graph has just been shown again. */
+static gboolean sampler_wake (CPUTempSampler *sm)
+{
+    GSource *source;
+
+    if (sm->replay || !sm->timer) return FALSE;
+    if ((source = g_main_context_find_source_by_id (sm->context, sm->timer))) g_source_destroy (source);
+    sm->stable = 0;
+    sampler_update (sm);
+    return FALSE;
+}
+
+/* Slow the sampler down while no instance's graph can be seen. Going the
+ * other way, it is woken straight away rather than left to finish a long
+ * wait. Clients are only added and removed in the main thread, so the list
+ * can be read here without the lock. */
+static void sampler_update_hidden (CPUTempSampler *sm)
+{
+    gboolean hidden = TRUE;
+    guint i;
+
+    for (i = 0; i < sm->clients->len; i++)
+        if (!((SampleClient *) g_ptr_array_index (sm->clients, i))->hidden) hidden = FALSE;
+
+    if (hidden == g_atomic_int_get (&sm->hidden)) return;
+    g_atomic_int_set (&sm->hidden, hidden);
+    if (!hidden && sm->thread) sampler_invoke (sm, (GSourceFunc) sampler_wake);
+}
+
+static void sampler_set_hidden (CPUTempSampler *sm, SampleClient *cl, gboolean hidden)
+{
+    cl->hidden = hidden;
+    sampler_update_hidden (sm);
+}
+
+/* Connect a plugin instance to the sampler. Its queue is filled from the
+ * next sample; a running sampler is woken so that the wait is short. */
+static SampleClient *sampler_subscribe (CPUTempSampler *sm, SensorPolicy policy, const char *selection, gboolean save_history)
+{
+    SampleClient *cl = g_new0 (SampleClient, 1);
+
+    cl->event_fd = eventfd (0, EFD_CLOEXEC | EFD_NONBLOCK);
+    cl->policy = policy;
+    cl->selection = g_strdup (selection);
+    cl->save_history = save_history;
+    g_mutex_lock (&sm->lock);
+    client_apply_policy (sm, cl);
+    g_ptr_array_add (sm->clients, cl);
+    g_mutex_unlock (&sm->lock);
+    sampler_update_policy (sm);
+    sampler_update_wanted (sm);
+    if (g_atomic_int_get (&sm->hidden)) sampler_update_hidden (sm);
+    else if (sm->thread) sampler_invoke (sm, (GSourceFunc) sampler_wake);
+    return cl;
+}
+
+static void sampler_unsubscribe (CPUTempSampler *sm, SampleClient *cl)
+{
+    int i;
+
+    g_mutex_lock (&sm->lock);
+    g_ptr_array_remove (sm->clients, cl);
+    g_mutex_unlock (&sm->lock);
+    sampler_update_hidden (sm);
+    sampler_update_wanted (sm);
+    sampler_update_policy (sm);
+
+    for (i = 0; i < SAMPLE_QUEUE_SIZE; i++) g_free (cl->queue.slot[i].temperature);
+    if (cl->event_fd >= 0) close (cl->event_fd);
+    g_free (cl->selection);
+    g_free (cl->roles);
+    g_free (cl->weights);
+    g_free (cl);
+}
+
+static gpointer sampler_thread (gpointer data)
+{
+    CPUTempSampler *sm = (CPUTempSampler *) data;
+    gint64 start = g_get_monotonic_time ();
+    GSource *source;
+
+    g_main_context_push_thread_default (sm->context);
+    if (sm->publish) sm->shm = shm_publish_open ();
+
+    if (sm->replay)
+    {
+        replay_start (sm);
+        g_main_loop_run (sm->loop);
+        g_main_context_pop_thread_default (sm->context);
+        return NULL;
+    }
+
+    /* Find the system thermal sensors and throttle status */
+    sm->ispi = is_pi ();
+    check_sensors (sm);
+    check_throttle (sm);
+    find_cpufreq (sm);
+    sampler_update_backend (sm);
+    g_message ("cputemp: Sensor discovery took %.1f ms", (g_get_monotonic_time () - start) / 1000.0);
+
+    /* There is no cheap notification of hotplugged sensors without a udev
+     * dependency, so look for changes now and then. */
+    source = g_timeout_source_new_seconds (SENSOR_RESCAN_INTERVAL);
+    g_source_set_callback (source, (GSourceFunc) sampler_rescan, sm, NULL);
+    g_source_attach (source, sm->context);
+    g_source_unref (source);
+
+    sampler_update (sm);
+    g_main_loop_run (sm->loop);
+    g_main_context_pop_thread_default (sm->context);
+    return NULL;
+}
+
+static CPUTempSampler *sampler_new (const char *root, const char *throttle_file, ReadBackend backend)
+{
+    CPUTempSampler *sm = g_new0 (CPUTempSampler, 1);
+
+    sm->root = g_strdup (root ? root : "");
+    sm->throttle.root = sm->root;
+    sm->backend = backend;
+    sm->throttle_file = g_strdup (throttle_file);
+    sm->throttle.file.fd = -1;
+    sm->sensors = g_ptr_array_new ();
+    sm->cpufreq = g_ptr_array_new_with_free_func ((GDestroyNotify) sensor_free);
+    sm->clients = g_ptr_array_new ();
+    g_mutex_init (&sm->lock);
+    sm->created = g_get_monotonic_time ();
+    return sm;
+}
+
+static void sampler_start (CPUTempSampler *sm)
+{
+    sm->context = g_main_context_new ();
+    sm->loop = g_main_loop_new (sm->context, FALSE);
+    sm->thread = g_thread_new ("cputemp", sampler_thread, sm);
+}
+
+static void sampler_free (CPUTempSampler *sm)
+{
+    if (sm->thread)
+    {
+        sampler_invoke (sm, (GSourceFunc) sampler_quit);
+        g_thread_join (sm->thread);
+        g_main_loop_unref (sm->loop);
+        g_main_context_unref (sm->context);
+    }
+
+    sampler_log_stats (sm);
+#ifdef HAVE_LINUX_IO_URING_H
+    uring_free (sm->ring);
+#endif
+    free_sensors (sm);
+    g_ptr_array_free (sm->sensors, TRUE);
+    g_mutex_clear (&sm->lock);
+    g_ptr_array_free (sm->clients, TRUE);
+    g_free (sm->current.temperature);
+    close_throttle (&sm->throttle);
+    g_ptr_array_free (sm->cpufreq, TRUE);
+    history_file_close (sm->history);
+    shm_publish_close (sm->shm);
+    metrics_free (sm->metrics);
+    replay_free (sm->replay);
+    g_free (sm->throttle_file);
+    g_free (sm->root);
+    g_free (sm);
+}
+
+/* Match the per-sensor histories to the sensor slots in a sample. Slots are
+ * only ever added, so existing histories stay where they are; a slot whose
+ * sensor has changed since the last sample has its history cleared. */
+static void sync_sensors (CPUTempPlugin *c, const CPUTempSample *smp)
+{
+    CPUTempSampler *sm = c->sampler;
+    CPUTempSensor *s;
+    guint id;
+    int i;
+
+    if (smp->numsensors > c->numsensors)
+    {
+        c->alloc_bytes += (smp->numsensors - c->numsensors) * (c->ring.capacity * sizeof (gint16) + sizeof (gint) + sizeof (guint));
+        c->sensor_stats = g_renew (gint16, c->sensor_stats, smp->numsensors * c->ring.capacity);
+        memset (&c->sensor_stats[c->numsensors * c->ring.capacity], 0, (smp->numsensors - c->numsensors) * c->ring.capacity * sizeof (gint16));
+        c->temperature = g_renew (gint, c->temperature, smp->numsensors);
+        c->sensor_ids = g_renew (guint, c->sensor_ids, smp->numsensors);
+        for (i = c->numsensors; i < smp->numsensors; i++)
+        {
+            c->temperature[i] = SENSOR_NONE;
+            c->sensor_ids[i] = 0;
+        }
+        c->numsensors = smp->numsensors;
+        c->redraw_full = TRUE;
+    }
+
+    if (smp->generation == c->generation) return;
+    g_mutex_lock (&sm->lock);
+    for (i = 0; i < c->numsensors; i++)
+    {
+        s = i < sm->sensors->len ? g_ptr_array_index (sm->sensors, i) : NULL;
+        id = s ? s->id : 0;
+        if (id == c->sensor_ids[i]) continue;
+        memset (&c->sensor_stats[i * c->ring.capacity], 0, c->ring.capacity * sizeof (gint16));
+        c->sensor_ids[i] = id;
+        c->redraw_full = TRUE;
+    }
+    g_mutex_unlock (&sm->lock);
+    c->generation = smp->generation;
 }
 
-static gint proc_get_temperature (char const *sensor_path)
+static void record_open (CPUTempPlugin *c, const char *path)
 {
-    FILE *state;
-    char buf[256], sstmp[100];
-    char *pstr;
+    if (!(c->record = fopen (path, "w")))
+    {
+        g_warning ("cputemp: cannot open trace %s - %s", path, strerror (errno));
+        return;
+    }
+    setvbuf (c->record, NULL, _IOLBF, 0);
+    fprintf (c->record, "%s\n# time throttle temp sensors readings...\n", TRACE_MAGIC);
+}
 
-    if (sensor_path == NULL) return -1;
+/* Append a sample to the trace being recorded, preceded by the sensor labels
+ * whenever the registry has changed. The format is described at TraceReplay. */
+static void record_sample (CPUTempPlugin *c, const CPUTempSample *smp)
+{
+    CPUTempSensor *s;
+    char buf[G_ASCII_DTOSTR_BUF_SIZE];
+    int i;
 
-    snprintf (sstmp, sizeof (sstmp), "%s%s", sensor_path, PROC_THERMAL_TEMPF);
+    if (!c->record) return;
+    if (!c->record_start) c->record_start = smp->time;
 
-    if (!(state = fopen( sstmp, "r")))
+    if (smp->generation != c->record_generation)
     {
-        g_warning ("cputemp: cannot open %s", sstmp);
-        return -1;
+        g_mutex_lock (&c->sampler->lock);
+        for (i = 0; i < c->sampler->sensors->len; i++)
+            if ((s = g_ptr_array_index (c->sampler->sensors, i)))
+                fprintf (c->record, TRACE_SENSOR "%d %s\n", i, s->label);
+        g_mutex_unlock (&c->sampler->lock);
+        c->record_generation = smp->generation;
     }
 
-    while (fgets (buf, 256, state) && !(pstr = strstr (buf, "temperature:")));
-    if (pstr)
+    fprintf (c->record, "%" G_GINT64_FORMAT " 0x%x %s %d", smp->time - c->record_start, smp->throttle, format_degrees (buf, smp->temp), smp->numsensors);
+    for (i = 0; i < smp->numsensors; i++)
     {
-        pstr += 12;
-        while (*pstr && *pstr == ' ') ++pstr;
-
-        pstr[strlen (pstr) - 3] = '\0';
-        fclose (state);
-        return atoi (pstr);
+        if (smp->temperature[i] == SENSOR_NONE) fputs (" -", c->record);
+        else fprintf (c->record, " %s", format_degrees (buf, smp->temperature[i]));
     }
+    fputc ('\n', c->record);
+}
 
-    fclose (state);
-    return -1;
+/* Round a temperature in hundredths of a degree down to a whole step, in degrees */
+static int round_down (int val, int step)
+{
+    step *= 100;
+    return (val >= 0 ? val / step : (val - step + 1) / step) * step / 100;
 }
 
-static gint _get_reading (const char *path)
+/* Set the bounds the graph is drawn with: those set by the user, or when
+ * autoscaling, bounds fitted to the readings in the window. A fitted bound
+ * moves out as soon as a reading comes within the margin of it, but only moves
+ * back in once the readings have left a whole step clear, so that the axis
+ * doesn't jitter as readings wander across a step. The user's bounds are left
+ * as they are, to be saved. Returns TRUE if either bound moved. */
+static gboolean autoscale (CPUTempPlugin *c)
 {
-    FILE *state;
-    char buf[256];
-    char *pstr;
+    RollingStats *s = &c->stats;
+    int lower, upper, mid;
 
-    if (!(state = fopen (path, "r")))
+    if (!c->auto_scale || !s->count)
     {
-        g_warning ("cputemp: cannot open %s", path);
-        return -1;
+        lower = c->lower_temp;
+        upper = c->upper_temp;
+        goto done;
     }
 
-    while (fgets (buf, 256, state) && !(pstr = buf));
-    if (pstr)
+    lower = round_down (stats_min (s) - AUTOSCALE_MARGIN * 100, AUTOSCALE_STEP);
+    upper = -round_down (-(stats_max (s) + AUTOSCALE_MARGIN * 100), AUTOSCALE_STEP);
+    if (upper - lower < AUTOSCALE_MIN_SPAN)
     {
-        fclose (state);
-        return atoi (pstr) / 1000;
+        mid = (lower + upper) / 2;
+        lower = round_down ((mid - AUTOSCALE_MIN_SPAN / 2) * 100, AUTOSCALE_STEP);
+        upper = lower + AUTOSCALE_MIN_SPAN;
     }
 
-    fclose (state);
-    return -1;
+    if (lower > c->view_lower && lower < c->view_lower + 2 * AUTOSCALE_STEP) lower = c->view_lower;
+    if (upper < c->view_upper && upper > c->view_upper - 2 * AUTOSCALE_STEP) upper = c->view_upper;
+
+done:
+    if (lower == c->view_lower && upper == c->view_upper) return FALSE;
+    c->view_lower = lower;
+    c->view_upper = upper;
+    return TRUE;
 }
 
-static gint sysfs_get_temperature (char const *sensor_path)
+/* Update the ring buffer with any samples published by the sampler thread.
+ * Each graph column covers SAMPLE_INTERVAL, so when the sampler has slowed
+ * down a sample fills every column since the previous one. While the graph is
+ * hidden nothing is drawn; it is redrawn in full once it can be seen. */
+static gboolean cpu_update (CPUTempPlugin *c)
 {
-    char sstmp [100];
+    CPUTempSample *smp;
+    gboolean updated = FALSE;
+    gint64 columns, start = g_get_monotonic_time ();
+    guint slot;
+    gint temp;
+    int i;
 
-    if (sensor_path == NULL) return -1;
+    if (c->hidden) c->redraw_full = TRUE;
+    while ((smp = queue_peek (&c->client->queue)))
+    {
+        if (c->column_time)
+        {
+            columns = (smp->time - c->column_time + SAMPLE_INTERVAL * 500) / (SAMPLE_INTERVAL * 1000);
+            if (columns < 1) columns = 1;
+            c->column_time += columns * SAMPLE_INTERVAL * 1000;
+            if (columns > c->ring.capacity) columns = c->ring.capacity;
+        }
+        else
+        {
+            columns = 1;
+            c->column_time = smp->time;
+        }
 
-    snprintf (sstmp, sizeof (sstmp), "%s%s", sensor_path, SYSFS_THERMAL_TEMPF);
+        sync_sensors (c, smp);
+        record_sample (c, smp);
+        for (i = 0; i < smp->numsensors; i++) c->temperature[i] = smp->temperature[i];
+        c->throttle = smp->throttle;
+        c->freq = smp->freq;
+        if (smp->freq_max != c->freq_max)
+        {
+            c->freq_max = smp->freq_max;
+            c->redraw_full = TRUE;
+        }
+        /* With no sensor combined, the ring entry is left empty and the
+         * statistics and history tiers skip the sample */
+        temp = smp->temp == COMBINED_NONE ? 0 : smp->temp;
+        while (columns--)
+        {
+            stats_add (&c->stats, &c->ring, c->ring.head, temp);
+            slot = ring_push (&c->ring, temp, throttle_flags (smp->throttle), smp->freq);
+            for (i = 0; i < c->numsensors; i++)
+                c->sensor_stats[i * c->ring.capacity + slot] = i < smp->numsensors && smp->temperature[i] != SENSOR_NONE ? smp->temperature[i] : 0;
+            for (i = 0; temp && i < NUM_TIERS; i++)
+                history_add (&c->tiers[i], c->column_time + c->time_offset - columns * SAMPLE_INTERVAL * 1000, temp, smp->throttle, smp->freq);
+            if (!c->redraw_full) redraw_graph (c, FALSE);
+        }
+        queue_pop (&c->client->queue);
+        updated = TRUE;
+    }
 
-    return _get_reading (sstmp);
+    if (updated)
+    {
+        if (c->start_time)
+        {
+            g_message ("cputemp: First sample %.1f ms after start", (g_get_monotonic_time () - c->start_time) / 1000.0);
+            c->start_time = 0;
+            c->overlay_val = G_MININT;
+        }
+        if (autoscale (c)) c->redraw_full = TRUE;
+        if (!c->hidden) redraw_pixmap (c);
+        if (c->sampler->instrument) hist_add (&c->render_time, g_get_monotonic_time () - start);
+    }
+    return TRUE;
 }
 
-static gint hwmon_get_temperature (char const *sensor_path)
+/* Rebuild the ring buffer and history tiers from a saved history file. Records
+ * are spread over graph columns in the same way as live samples. */
+static void load_history (CPUTempPlugin *c, CPUTempHistoryHeader *hdr)
 {
-    if (sensor_path == NULL) return -1;
-    return _get_reading (sensor_path);
-}
+    CPUTempHistoryRecord *rec;
+    gint64 now = g_get_real_time (), period = SAMPLE_INTERVAL * 1000;
+    gint64 t, prev = 0, col_time, columns, k;
+    guint i, slot;
+    int j;
 
+    /* Index the ring so that its newest entry is for the current time */
+    c->ring.head = c->ring.capacity;
 
-static int add_sensor (CPUTempPlugin* c, char const* sensor_path, GetTempFunc get_temp)
-{
-    if (c->numsensors + 1 > MAX_NUM_SENSORS)
+    for (i = 0; i < hdr->count; i++)
     {
-        g_message ("cputemp: Too many sensors (max %d), ignoring '%s'",
-            MAX_NUM_SENSORS, sensor_path);
-        return -1;
-    }
+        rec = cputemp_history_record (hdr, i);
+        t = rec->time * (gint64) G_USEC_PER_SEC + rec->msec * 1000;
+        if (t > now || t < prev || rec->temp == COMBINED_NONE) continue;
 
-    c->sensor_array[c->numsensors] = g_strdup (sensor_path);
-    c->get_temperature[c->numsensors] = get_temp;
-    c->numsensors++;
+        /* A gap longer than the slowest sample interval was a restart, and is left empty. */
+        columns = prev ? (t - prev + period / 2) / period : 1;
+        if (columns < 1 || columns > SAMPLE_INTERVAL_HIDDEN / SAMPLE_INTERVAL + 1) columns = 1;
+        prev = t;
 
-    g_message ("cputemp: Added sensor %s", sensor_path);
+        while (columns--)
+        {
+            col_time = t - columns * period;
+            for (j = 0; j < NUM_TIERS; j++)
+                history_add (&c->tiers[j], col_time, rec->temp, rec->throttle, 0);
+            k = (now - col_time) / period;
+            if (k < c->ring.capacity)
+            {
+                slot = ring_slot (&c->ring, c->ring.head - 1 - k);
+                c->ring.temp[slot] = rec->temp;
+                c->ring.flags[slot] = throttle_flags (rec->throttle);
+            }
+        }
+    }
 
-    return 0;
+    c->column_time = now - c->time_offset;
+    stats_reset (&c->stats, &c->ring, c->pixmap_width);
+    autoscale (c);
+    c->redraw_full = TRUE;
+    redraw_pixmap (c);
 }
 
-
-static gboolean try_hwmon_sensors (CPUTempPlugin* c, const char *path)
+/* Main loop callback when the sampler has signalled new samples. */
+static gboolean samples_ready (gint fd, GIOCondition cond, gpointer user_data)
 {
-    GDir *sensorsDirectory;
-    const char *sensor_name;
-    char sensor_path[100], buf[256];
-    FILE *fp;
-    gboolean found = FALSE;
+    guint64 count;
+
+    if (read (fd, &count, sizeof (count)) < 0 && errno != EAGAIN)
+        g_warning ("cputemp: cannot read sample signal - %s", strerror (errno));
+    ((CPUTempPlugin *) user_data)->wakeups++;
+    return cpu_update ((CPUTempPlugin *) user_data);
+}
 
-    if (!(sensorsDirectory = g_dir_open (path, 0, NULL))) return found;
+/* Handler for configure_event on drawing area. */
+static void cpu_configuration_changed (LXPanel *panel, GtkWidget *p)
+{
+    CPUTempPlugin *c = lxpanel_plugin_get_data (p);
 
-    while ((sensor_name = g_dir_read_name (sensorsDirectory)))
+    /* Allocate pixmap and statistics buffer without border pixels. */
+    guint new_pixmap_height = panel_get_icon_size (panel) - (BORDER_SIZE << 1);
+    guint new_pixmap_width = (new_pixmap_height * 3) >> 1;
+    guint old_capacity = c->ring.capacity;
+    gboolean grown;
+    if (new_pixmap_width < 50) new_pixmap_width = 50;
+    if ((new_pixmap_width > 0) && (new_pixmap_height > 0))
     {
-        if (strncmp (sensor_name, "temp", 4) == 0 &&
-            strcmp (&sensor_name[5], "_input") == 0)
+        /* The ring buffer only needs to grow if the graph is wider than it has
+         * ever been; otherwise the graph just shows more or fewer entries. */
+        if ((grown = ring_reserve (&c->ring, new_pixmap_width)))
         {
-            snprintf (sensor_path, sizeof (sensor_path), "%s/temp%c_label", path, sensor_name[4]);
-            fp = fopen (sensor_path, "r");
-            buf[0] = '\0';
-            if (fp)
-            {
-                if (fgets (buf, 256, fp))
-                {
-                    char *pp = strchr (buf, '\n');
-                    if (pp) *pp = '\0';
-                }
-                fclose (fp);
-            }
-            snprintf (sensor_path, sizeof (sensor_path), "%s/%s", path, sensor_name);
-            add_sensor (c, sensor_path, hwmon_get_temperature);
-            found = TRUE;
+            gint16 *new_sensor_stats = g_new0 (gint16, c->numsensors * c->ring.capacity);
+            int i;
+            for (i = 0; i < c->numsensors; i++)
+                ring_relayout (&new_sensor_stats[i * c->ring.capacity], &c->sensor_stats[i * old_capacity], sizeof (gint16),
+                    old_capacity, c->ring.capacity, c->ring.head);
+            g_free (c->sensor_stats);
+            c->sensor_stats = new_sensor_stats;
+            c->raster = g_renew (gint32, c->raster, RASTER_ARRAYS * c->ring.capacity);
+            c->alloc_bytes += c->ring.capacity * (sizeof (gint16) + sizeof (guint16) + sizeof (guint8) + c->numsensors * sizeof (gint16)
+                + RASTER_ARRAYS * sizeof (gint32) + 2 * sizeof (StatsEntry));
+        }
+
+        /* The statistics cover the entries shown, so start again if that changes. */
+        if (grown || new_pixmap_width != c->stats.window)
+        {
+            stats_reset (&c->stats, &c->ring, new_pixmap_width);
+            autoscale (c);
         }
+
+        /* Allocate or reallocate pixmap. */
+        c->pixmap_width = new_pixmap_width;
+        c->pixmap_height = new_pixmap_height;
+        if (c->pixmap) cairo_surface_destroy (c->pixmap);
+        c->pixmap = cairo_image_surface_create (CAIRO_FORMAT_RGB24, c->pixmap_width, c->pixmap_height);
+        if (c->graph) cairo_surface_destroy (c->graph);
+        c->graph = cairo_image_surface_create (CAIRO_FORMAT_RGB24, c->pixmap_width, c->pixmap_height);
+        if (c->overlay) cairo_surface_destroy (c->overlay);
+        c->overlay = cairo_image_surface_create (CAIRO_FORMAT_ARGB32, c->pixmap_width, c->pixmap_height);
+        gtk_widget_set_size_request (c->da, c->pixmap_width, c->pixmap_height);
+
+        /* Redraw pixmap at the new size. */
+        c->redraw_full = TRUE;
+        redraw_pixmap (c);
     }
-    g_dir_close (sensorsDirectory);
-    return found;
 }
 
-static void find_hwmon_sensors (CPUTempPlugin* c)
+/* Handler for draw signal on drawing area. */
+static gboolean draw (GtkWidget * widget, cairo_t * cr, CPUTempPlugin * c)
 {
-    char dir_path[100];
-    char *cptr;
-    int i; /* sensor type num, we'll try up to 4 */
-
-    for (i = 0; i < 4; i++)
+    /* Paint the pixmap onto the drawing area, centred in its allocation. */
+    if (c->pixmap != NULL)
     {
-        snprintf (dir_path, sizeof (dir_path), "/sys/class/hwmon/hwmon%d/device", i);
-        if (try_hwmon_sensors (c, dir_path)) continue;
-        /* no sensors found under device/, try parent dir */
-        cptr = strrchr (dir_path, '/');
-        *cptr = '\0';
-        try_hwmon_sensors (c, dir_path);
+        int x = (gtk_widget_get_allocated_width (widget) - (int) c->pixmap_width) / 2;
+        int y = (gtk_widget_get_allocated_height (widget) - (int) c->pixmap_height) / 2;
+        cairo_set_source_surface (cr, c->pixmap, x, y);
+        cairo_paint (cr);
     }
+    return FALSE;
 }
 
-static void find_sensors (CPUTempPlugin* c, char const* directory, char const* subdir_prefix, GetTempFunc get_temp)
+/* Track whether the graph can be seen. While it can't, the sampler drops to
+ * a low rate which just keeps the history, and nothing is drawn; when it can
+ * be seen again, the graph is caught up with a single full redraw. */
+static void update_visibility (CPUTempPlugin *c)
 {
-    GDir *sensorsDirectory;
-    const char *sensor_name;
-    char sensor_path[100];
+    gboolean hidden = !c->mapped || c->obscured || c->screensaver;
 
-    if (!(sensorsDirectory = g_dir_open (directory, 0, NULL))) return;
+    if (hidden == c->hidden) return;
+    c->hidden = hidden;
+    sampler_set_hidden (c->sampler, c->client, hidden);
+    if (!hidden && c->redraw_full) redraw_pixmap (c);
+}
 
-    /* Scan the thermal_zone directory for available sensors */
-    while ((sensor_name = g_dir_read_name (sensorsDirectory)))
-    {
-        if (sensor_name[0] == '.') continue;
-        if (subdir_prefix)
-        {
-            if (strncmp (sensor_name, subdir_prefix, strlen (subdir_prefix)) != 0)  continue;
-        }
-        snprintf (sensor_path, sizeof (sensor_path), "%s%s/", directory, sensor_name);
-        add_sensor (c, sensor_path, get_temp);
-    }
-    g_dir_close (sensorsDirectory);
+/* Handlers for map and unmap on drawing area; the panel unmaps its contents when it auto-hides. */
+static void da_map (GtkWidget *widget, CPUTempPlugin *c)
+{
+    c->mapped = TRUE;
+    update_visibility (c);
 }
 
-static void check_sensors (CPUTempPlugin *c)
+static void da_unmap (GtkWidget *widget, CPUTempPlugin *c)
 {
-    int i;
+    c->mapped = FALSE;
+    update_visibility (c);
+}
+
+/* Handler for visibility-notify-event on drawing area, when covered by other windows. */
+static gboolean da_visibility (GtkWidget *widget, GdkEventVisibility *event, CPUTempPlugin *c)
+{
+    c->obscured = (event->state == GDK_VISIBILITY_FULLY_OBSCURED);
+    update_visibility (c);
+    return FALSE;
+}
 
-    for (i = 0; i < c->numsensors; i++) g_free (c->sensor_array[i]);
-    c->numsensors = 0;
+/* Handler for the screensaver's ActiveChanged signal; a locked or blanked screen counts as hidden. */
+static void screensaver_changed (GDBusConnection *bus, const gchar *sender, const gchar *path, const gchar *iface,
+    const gchar *signal, GVariant *params, gpointer user_data)
+{
+    CPUTempPlugin *c = (CPUTempPlugin *) user_data;
+    gboolean active;
 
-    find_sensors (c, PROC_THERMAL_DIRECTORY, NULL, proc_get_temperature);
-    find_sensors (c, SYSFS_THERMAL_DIRECTORY, SYSFS_THERMAL_SUBDIR_PREFIX, sysfs_get_temperature);
-    if (c->numsensors == 0) find_hwmon_sensors (c);
-    
-    g_message ("cputemp: Found %d sensors", c->numsensors);
+    if (!g_variant_is_of_type (params, G_VARIANT_TYPE ("(b)"))) return;
+    g_variant_get (params, "(b)", &active);
+    c->screensaver = active;
+    update_visibility (c);
 }
 
-/* Redraw after timer callback or resize. */
-static void redraw_pixmap (CPUTempPlugin * c)
+/* Callback when connected to the session bus. If the plugin has been
+ * destroyed in the meantime, the connection has been cancelled. */
+static void bus_ready (GObject *source, GAsyncResult *res, gpointer user_data)
 {
-    cairo_t * cr = cairo_create(c->pixmap);
-    cairo_set_line_width (cr, 1.0);
-    /* Erase pixmap. */
-    cairo_rectangle(cr, 0, 0, c->pixmap_width, c->pixmap_height);
-    cairo_set_source_rgba(cr, c->background_color.blue,  c->background_color.green, c->background_color.red, c->background_color.alpha);
-    cairo_fill(cr);
+    CPUTempPlugin *c;
+    GDBusConnection *bus;
+    GError *err = NULL;
+    int i;
 
-    /* Recompute pixmap. */
-    unsigned int i;
-    unsigned int drawing_cursor = c->ring_cursor;
-    for (i = 0; i < c->pixmap_width; i++)
+    if (!(bus = g_bus_get_finish (res, &err)))
     {
-        /* Draw one bar of the CPU usage graph. */
-        if (c->stats_cpu[drawing_cursor] != 0.0)
-        {
-            if (c->stats_throttle[drawing_cursor] & 0x8)
-                cairo_set_source_rgba(cr, c->high_throttle_color.blue,  c->high_throttle_color.green, c->high_throttle_color.red, c->high_throttle_color.alpha);
-            else if (c->stats_throttle[drawing_cursor] & 0x2)
-                cairo_set_source_rgba(cr, c->low_throttle_color.blue,  c->low_throttle_color.green, c->low_throttle_color.red, c->low_throttle_color.alpha);
-            else
-                cairo_set_source_rgba(cr, c->foreground_color.blue,  c->foreground_color.green, c->foreground_color.red, c->foreground_color.alpha);
+        if (!g_error_matches (err, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+            g_warning ("cputemp: cannot connect to session bus - %s", err->message);
+        g_error_free (err);
+        return;
+    }
 
-            float val = c->stats_cpu[drawing_cursor] * 100.0;
-            val -= c->lower_temp;
-            val /= (c->upper_temp - c->lower_temp);
-            cairo_move_to (cr, i + 0.5, c->pixmap_height);
-            cairo_line_to (cr, i + 0.5, c->pixmap_height - val * c->pixmap_height);
-            cairo_stroke (cr);
-        }
+    c = (CPUTempPlugin *) user_data;
+    c->bus = bus;
+    for (i = 0; i < G_N_ELEMENTS (screensaver_interfaces); i++)
+        c->screensaver_sub[i] = g_dbus_connection_signal_subscribe (bus, NULL, screensaver_interfaces[i], "ActiveChanged",
+            NULL, NULL, G_DBUS_SIGNAL_FLAGS_NONE, screensaver_changed, c, NULL);
+}
 
-        /* Increment and wrap drawing cursor. */
-        drawing_cursor += 1;
-        if (drawing_cursor >= c->pixmap_width) drawing_cursor = 0;
-    }
+/* Work out the range of temperatures over the time shown on the graph. */
+static gboolean visible_stats (CPUTempPlugin *c, gint *min, gint *max, float *mean)
+{
+    HistoryTier *h;
+    HistoryBucket *b;
+    gint64 sum = 0;
+    gint count = 0;
+    unsigned int i;
 
-    /* draw a border in black */
-    cairo_set_source_rgb (cr, 0, 0, 0);
-    cairo_set_line_width (cr, 1);
-    cairo_move_to (cr, 0, 0);
-    cairo_line_to (cr, 0, c->pixmap_height);
-    cairo_line_to (cr, c->pixmap_width, c->pixmap_height);
-    cairo_line_to (cr, c->pixmap_width, 0);
-    cairo_line_to (cr, 0, 0);
-    cairo_stroke (cr);
+    /* The recent samples have their statistics kept up to date as they arrive */
+    if (c->scale == SCALE_SAMPLES)
+    {
+        if (!c->stats.count) return FALSE;
+        *min = whole_degrees (stats_min (&c->stats));
+        *max = whole_degrees (stats_max (&c->stats));
+        *mean = c->stats.sum / (100.0 * c->stats.count);
+        return TRUE;
+    }
 
-    int fontsize = 12;
-    if (c->pixmap_width > 50) fontsize = c->pixmap_height / 3;
-    char buffer[10];
-    int val = 100 * c->stats_cpu[c->ring_cursor ? c->ring_cursor - 1 : c->pixmap_width - 1];
-    sprintf (buffer, "%3d°", val);
-    cairo_select_font_face (cr, "monospace", CAIRO_FONT_SLANT_NORMAL, CAIRO_FONT_WEIGHT_NORMAL);
-    cairo_set_font_size (cr, fontsize);
-    cairo_set_source_rgb (cr, 0, 0, 0);
-    cairo_move_to (cr, (c->pixmap_width >> 1) - ((fontsize * 5) / 4), ((c->pixmap_height + fontsize) >> 1) - 1);
-    cairo_show_text (cr, buffer);
+    *min = G_MAXINT;
+    *max = G_MININT;
+    h = &c->tiers[c->scale - 1];
+    for (i = 0; i < c->pixmap_width; i++)
+    {
+        if (!(b = history_bucket (h, h->current - i))) continue;
+        if (b->min < *min) *min = b->min;
+        if (b->max > *max) *max = b->max;
+        sum += b->sum;
+        count += b->count;
+    }
+    if (!count) return FALSE;
+    *min = whole_degrees (*min);
+    *max = whole_degrees (*max);
+    *mean = sum / (100.0 * count);
+    return TRUE;
+}
 
-    /* check_cairo_status(cr); */
-    cairo_destroy(cr);
+/* Instrumentation counters, as median/99th percentile/maximum times. The
+ * sampler's counters are read without locking, so may be slightly stale. */
+static void format_counters (CPUTempPlugin *c, GString *str)
+{
+    CPUTempSampler *sm = c->sampler;
+    CPUTempSensor *s;
+    double hours;
+    int i;
 
-    /* Redraw pixmap. */
-    GdkPixbuf *pixbuf = gdk_pixbuf_new_from_data (cairo_image_surface_get_data (c->pixmap), GDK_COLORSPACE_RGB, TRUE, 8, c->pixmap_width, c->pixmap_height, c->pixmap_width *4, NULL, NULL);
-    gtk_image_set_from_pixbuf (GTK_IMAGE (c->da), pixbuf);
+    if (!sm->instrument) return;
+    g_string_append_printf (str, "\n\nSamples: %u, missed %u, dropped %u, instances %u", sm->stats.samples, sm->missed, sm->dropped, sm->clients->len);
+    g_string_append_printf (str, "\nSample and history buffers: %" G_GUINT64_FORMAT " bytes", sm->alloc_bytes + c->alloc_bytes);
+    hist_format (str, "Late", &sm->late);
+    hist_format (str, "Throttle", &sm->throttle_time);
+    hist_format (str, "Batch", &sm->batch_time);
+    hist_format (str, "Render", &c->render_time);
+    hours = (g_get_monotonic_time () - sm->created) / (3600.0 * G_USEC_PER_SEC);
+    g_string_append_printf (str, "\nWakeups per hour: sampler %.0f, panel %.0f, redraws %.0f%s",
+        sm->wakeups / hours, c->wakeups / hours, c->redraws / hours, c->hidden ? " (hidden)" : "");
+    g_mutex_lock (&sm->lock);
+    for (i = 0; i < sm->sensors->len; i++)
+        if ((s = g_ptr_array_index (sm->sensors, i))) hist_format (str, s->label, &s->read_time);
+    g_mutex_unlock (&sm->lock);
 }
 
-static gint get_temperature (CPUTempPlugin *c)
+/* Append the full instrumentation counters to a file in the user's cache
+ * directory, in response to SIGUSR2. */
+static gboolean dump_counters (CPUTempPlugin *c)
 {
-    gint max = -273, cur, i;
+    CPUTempSampler *sm = c->sampler;
+    CPUTempSensor *s;
+    char *path, tbuf[32];
+    time_t t = time (NULL);
+    struct tm tm;
+    FILE *fp;
+    int i;
 
-    for (i = 0; i < c->numsensors; i++)
+    path = g_build_filename (g_get_user_cache_dir (), "lxpanel", STATS_FILE, NULL);
+    if (!(fp = fopen (path, "a")))
     {
-        cur = c->get_temperature[i] (c->sensor_array[i]);
-        if (cur > max) max = cur;
-        c->temperature[i] = cur;
+        g_warning ("cputemp: cannot open %s - %s", path, strerror (errno));
+        g_free (path);
+        return TRUE;
     }
 
-    return max;
+    localtime_r (&t, &tm);
+    strftime (tbuf, sizeof (tbuf), "%Y-%m-%d %H:%M:%S", &tm);
+    fprintf (fp, "# %s pid %d\n", tbuf, getpid ());
+    fprintf (fp, "samples: %u, missed %u, dropped %u, instances %u\n", sm->stats.samples, sm->missed, sm->dropped, sm->clients->len);
+    fprintf (fp, "sample and history buffers: sampler %" G_GUINT64_FORMAT ", plugin %" G_GUINT64_FORMAT " bytes\n", sm->alloc_bytes, c->alloc_bytes);
+    hist_dump (fp, "late", &sm->late);
+    hist_dump (fp, "throttle", &sm->throttle_time);
+    hist_dump (fp, "batch", &sm->batch_time);
+    hist_dump (fp, "render", &c->render_time);
+    fprintf (fp, "wakeups: sampler %u, panel %u, redraws %u in %.0f s%s\n", sm->wakeups, c->wakeups, c->redraws,
+        (g_get_monotonic_time () - sm->created) / (double) G_USEC_PER_SEC, c->hidden ? ", hidden" : "");
+    g_mutex_lock (&sm->lock);
+    for (i = 0; i < sm->sensors->len; i++)
+        if ((s = g_ptr_array_index (sm->sensors, i))) hist_dump (fp, s->path, &s->read_time);
+    g_mutex_unlock (&sm->lock);
+    fputc ('\n', fp);
+    fclose (fp);
+
+    g_message ("cputemp: Counters written to %s", path);
+    g_free (path);
+    return TRUE;
 }
 
-static char *get_string (char *cmd)
+/* Conditions reported by the throttle status word. Each has a bit for whether
+ * it holds now, and another, shifted up by 16, for whether it has since boot. */
+static const struct
 {
-    char *line = NULL, *res = NULL;
-    size_t len = 0;
-    FILE *fp = popen (cmd, "r");
+    guint bit;
+    const char *name;
+} throttle_bits[] = {
+    { 0x1, N_("under-voltage") },
+    { 0x2, N_("ARM frequency capped") },
+    { 0x4, N_("throttled") },
+    { 0x8, N_("soft temperature limit") }
+};
 
-    if (fp == NULL) return NULL;
-    if (getline (&line, &len, fp) > 0)
+/* Describe the throttle status word, and the CPU frequency it has led to. */
+static void format_throttle (CPUTempPlugin *c, GString *str)
+{
+    const char *sep;
+    int i, shift;
+
+    if (c->freq && c->freq_max) g_string_append_printf (str, _("\nCPU clock %u of %u MHz"), c->freq, c->freq_max);
+    for (shift = 0; shift <= 16; shift += 16)
     {
-        res = line;
-        while (*res)
+        if (!((c->throttle >> shift) & THROTTLE_CURRENT)) continue;
+        g_string_append (str, shift ? _("\nSince boot: ") : _("\nNow: "));
+        for (i = 0, sep = ""; i < G_N_ELEMENTS (throttle_bits); i++)
         {
-            if (g_ascii_isspace (*res)) *res = 0;
-            res++;
+            if (!((c->throttle >> shift) & throttle_bits[i].bit)) continue;
+            g_string_append_printf (str, "%s%s", sep, _(throttle_bits[i].name));
+            sep = ", ";
         }
-        res = g_strdup (line);
     }
-    pclose (fp);
-    g_free (line);
-    return res;
 }
 
-static int get_throttle (CPUTempPlugin *c)
+/* Handler for query-tooltip signal on plugin, showing statistics for the visible graph. */
+static gboolean query_tooltip (GtkWidget *widget, gint x, gint y, gboolean keyboard, GtkTooltip *tooltip, CPUTempPlugin *c)
 {
-    char *buf;
-    unsigned int val;
+    gint min, max, span;
+    float mean;
+    char *span_str, *text;
+    GString *str;
+    CPUTempSensor *s;
+    int i;
 
-    buf = get_string ("vcgencmd get_throttled");
-    if (!buf) return 0;
-    if (sscanf (buf, "throttled=0x%x", &val) != 1) val = 0;
-    g_free (buf);
-    return val;
-}
+    if (!visible_stats (c, &min, &max, &mean)) return FALSE;
 
-/* Periodic timer callback. */
-static gboolean cpu_update (CPUTempPlugin *c)
-{
-    if (g_source_is_destroyed (g_main_current_source ()))
-        return FALSE;
+    /* Time covered by graph, in minutes */
+    if (c->scale == SCALE_SAMPLES) span = (c->pixmap_width * SAMPLE_INTERVAL) / 60000;
+    else span = c->pixmap_width * (tier_spec[c->scale - 1].period / (60 * G_USEC_PER_SEC));
+    if (span < 60) span_str = g_strdup_printf (_("%d minutes"), span);
+    else span_str = g_strdup_printf (_("%d hours %d minutes"), span / 60, span % 60);
 
-    int t = get_temperature (c);
-    c->stats_cpu[c->ring_cursor] = t / 100.0;
-    c->stats_throttle[c->ring_cursor] = c->ispi ? get_throttle (c) : 0;
-    c->ring_cursor += 1;
-    if (c->ring_cursor >= c->pixmap_width) c->ring_cursor = 0;
+    text = g_strdup_printf (_("CPU temperature over last %s\nMinimum %d°\nMaximum %d°\nMean %.1f°"), span_str, min, max, mean);
+    str = g_string_new (text);
+    if (c->stats.ewma)
+        g_string_append_printf (str, _("\nSmoothed %.1f°, changing %+.1f° per minute"), c->stats.ewma, c->stats.rate);
+    format_throttle (c, str);
 
-    redraw_pixmap (c);
+    /* Current reading from each sensor. The registry may have changed since
+     * the last sample, so only sensors still in the slot they were read from
+     * are shown. */
+    g_mutex_lock (&c->sampler->lock);
+    for (i = 0; i < c->numsensors && i < c->sampler->sensors->len; i++)
+    {
+        s = g_ptr_array_index (c->sampler->sensors, i);
+        if (s && s->id == c->sensor_ids[i] && c->temperature[i] != SENSOR_NONE)
+            g_string_append_printf (str, "\n%s: %d°", s->label, whole_degrees (c->temperature[i]));
+    }
+    g_mutex_unlock (&c->sampler->lock);
+
+    if (c->debug_tooltip) format_counters (c, str);
+
+    gtk_tooltip_set_text (tooltip, str->str);
+    g_string_free (str, TRUE);
+    g_free (text);
+    g_free (span_str);
     return TRUE;
 }
 
-/* Handler for configure_event on drawing area. */
-static void cpu_configuration_changed (LXPanel *panel, GtkWidget *p)
+static void set_scale (CPUTempPlugin *c, TimeScale scale)
 {
-    CPUTempPlugin *c = lxpanel_plugin_get_data (p);
+    c->scale = scale;
+    config_group_set_int (c->settings, "TimeScale", c->scale);
+    c->redraw_full = TRUE;
+    redraw_pixmap (c);
+}
 
-    /* Allocate pixmap and statistics buffer without border pixels. */
-    guint new_pixmap_height = panel_get_icon_size (panel) - (BORDER_SIZE << 1);
-    guint new_pixmap_width = (new_pixmap_height * 3) >> 1;
-    if (new_pixmap_width < 50) new_pixmap_width = 50;
-    if ((new_pixmap_width > 0) && (new_pixmap_height > 0))
-    {
-        /* If statistics buffer does not exist or it changed size, reallocate and preserve existing data. */
-        if ((c->stats_cpu == NULL) || (new_pixmap_width != c->pixmap_width))
-        {
-            float *new_stats_cpu = g_new0 (typeof (*c->stats_cpu), new_pixmap_width);
-            int *new_stats_throttle = g_new0 (typeof (*c->stats_throttle), new_pixmap_width);
-            if (c->stats_cpu != NULL)
-            {
-                if (new_pixmap_width > c->pixmap_width)
-                {
-                    /* New allocation is larger.
-                     * Introduce new "oldest" samples of zero following the cursor. */
-                    memcpy (&new_stats_cpu[0],
-                        &c->stats_cpu[0], c->ring_cursor * sizeof (float));
-                    memcpy (&new_stats_cpu[new_pixmap_width - c->pixmap_width + c->ring_cursor],
-                        &c->stats_cpu[c->ring_cursor], (c->pixmap_width - c->ring_cursor) * sizeof (float));
-                    memcpy (&new_stats_throttle[0],
-                        &c->stats_throttle[0], c->ring_cursor * sizeof (int));
-                    memcpy (&new_stats_throttle[new_pixmap_width - c->pixmap_width + c->ring_cursor],
-                        &c->stats_throttle[c->ring_cursor], (c->pixmap_width - c->ring_cursor) * sizeof (int));
-                }
-                else if (c->ring_cursor <= new_pixmap_width)
-                {
-                    /* New allocation is smaller, but still larger than the ring buffer cursor.
-                     * Discard the oldest samples following the cursor. */
-                    memcpy (&new_stats_cpu[0],
-                        &c->stats_cpu[0], c->ring_cursor * sizeof (float));
-                    memcpy (&new_stats_cpu[c->ring_cursor],
-                        &c->stats_cpu[c->pixmap_width - new_pixmap_width + c->ring_cursor], (new_pixmap_width - c->ring_cursor) * sizeof (float));
-                    memcpy (&new_stats_throttle[0],
-                        &c->stats_throttle[0], c->ring_cursor * sizeof (int));
-                    memcpy (&new_stats_throttle[c->ring_cursor],
-                        &c->stats_throttle[c->pixmap_width - new_pixmap_width + c->ring_cursor], (new_pixmap_width - c->ring_cursor) * sizeof (int));
-                }
-                else
-                {
-                    /* New allocation is smaller, and also smaller than the ring buffer cursor.
-                     * Discard all oldest samples following the ring buffer cursor and additional samples at the beginning of the buffer. */
-                    memcpy (&new_stats_cpu[0],
-                        &c->stats_cpu[c->ring_cursor - new_pixmap_width], new_pixmap_width * sizeof (float));
-                    memcpy (&new_stats_throttle[0],
-                        &c->stats_throttle[c->ring_cursor - new_pixmap_width], new_pixmap_width * sizeof (int));
-                    c->ring_cursor = 0;
-                }
-                g_free (c->stats_cpu);
-                g_free (c->stats_throttle);
-            }
-            c->stats_cpu = new_stats_cpu;
-            c->stats_throttle = new_stats_throttle;
-        }
+/* Handler for button press on plugin; left click cycles through time scales. */
+static gboolean cpu_button_press (GtkWidget *widget, GdkEventButton *event, LXPanel *panel)
+{
+    CPUTempPlugin *c = lxpanel_plugin_get_data (widget);
 
-        /* Allocate or reallocate pixmap. */
-        c->pixmap_width = new_pixmap_width;
-        c->pixmap_height = new_pixmap_height;
-        if (c->pixmap) cairo_surface_destroy (c->pixmap);
-        c->pixmap = cairo_image_surface_create (CAIRO_FORMAT_RGB24, c->pixmap_width, c->pixmap_height);
+    if (event->button != 1) return FALSE;
+    set_scale (c, (c->scale + 1) % NUM_SCALES);
+    return TRUE;
+}
 
-        /* Redraw pixmap at the new size. */
-        redraw_pixmap (c);
-    }
+/* Plugin constructor. */
+/* Log a setting of an instance joining the sampler which differs from the
+ * one the sampler was set up with, as the joining instance can't change it */
+static void check_shared_setting (const char *name, gboolean differs)
+{
+    if (differs) g_message ("cputemp: %s differs from the first instance's setting; using the first instance's", name);
 }
 
-/* Handler for expose_event on drawing area. */
-static gboolean draw (GtkWidget * widget, cairo_t * cr, CPUTempPlugin * c)
+static void check_shared_settings (CPUTempSampler *sm, config_setting_t *settings)
 {
-    /* Draw the requested part of the pixmap onto the drawing area.
-     * Translate it in both x and y by the border size. */
-    if (c->pixmap != NULL)
-    {
-        cairo_set_source_rgb (cr, 0, 0, 0); // FIXME: use black color from style
-        cairo_set_source_surface (cr, c->pixmap, BORDER_SIZE, BORDER_SIZE);
-        cairo_paint (cr);
-    }
-    return FALSE;
+    const char *str;
+    int val;
+
+    if (!config_setting_lookup_string (settings, "SensorRoot", &str)) str = "";
+    check_shared_setting ("SensorRoot", strcmp (str, sm->root) != 0);
+    if (!config_setting_lookup_string (settings, "ThrottleFile", &str)) str = NULL;
+    check_shared_setting ("ThrottleFile", g_strcmp0 (str, sm->throttle_file) != 0);
+    if (config_setting_lookup_int (settings, "ReadBackend", &val))
+        check_shared_setting ("ReadBackend", val != g_atomic_int_get (&sm->backend));
+    if (!config_setting_lookup_int (settings, "HwmonSensors", &val)) val = FALSE;
+    check_shared_setting ("HwmonSensors", (val != 0) != sm->hwmon);
+    if (!config_setting_lookup_int (settings, "Instrument", &val)) val = TRUE;
+    check_shared_setting ("Instrument", (val != 0) != sm->instrument);
+    if (!config_setting_lookup_int (settings, "PublishSamples", &val)) val = TRUE;
+    check_shared_setting ("PublishSamples", (val != 0) != sm->publish);
+    if (!config_setting_lookup_string (settings, "ReplayFile", &str)) str = NULL;
+    check_shared_setting ("ReplayFile", g_strcmp0 (str, sm->replay ? sm->replay->path : NULL) != 0);
+    if (!config_setting_lookup_string (settings, "MetricsFile", &str)) str = NULL;
+    check_shared_setting ("MetricsFile", g_strcmp0 (str, sm->metrics ? sm->metrics->path : NULL) != 0);
 }
 
-/* Plugin constructor. */
 static GtkWidget *cpu_constructor (LXPanel *panel, config_setting_t *settings)
 {
     /* Allocate and initialize plugin context */
     CPUTempPlugin *c = g_new0 (CPUTempPlugin, 1);
-    const char *str;
+    const char *str, *root;
     int val;
 
+    c->start_time = g_get_monotonic_time ();
+
 #ifdef ENABLE_NLS
     setlocale (LC_ALL, "");
     bindtextdomain (GETTEXT_PACKAGE, PACKAGE_LOCALE_DIR);
@@ -518,13 +4105,10 @@ static GtkWidget *cpu_constructor (LXPanel *panel, config_setting_t *settings)
     c->plugin = gtk_event_box_new ();
     lxpanel_plugin_set_data (c->plugin, c, cpu_destructor);
 
-    /* Allocate icon as a child of top level */
-    c->da = gtk_image_new ();
+    /* Allocate drawing area as a child of top level */
+    c->da = gtk_drawing_area_new ();
     gtk_container_add (GTK_CONTAINER (c->plugin), c->da);
 
-    /* Set up variables */
-    c->ispi = is_pi ();
-
     if (config_setting_lookup_string (settings, "Foreground", &str))
     {
         if (!gdk_rgba_parse (&c->foreground_color, str))
@@ -549,6 +4133,16 @@ static GtkWidget *cpu_constructor (LXPanel *panel, config_setting_t *settings)
             gdk_rgba_parse (&c->high_throttle_color, "red");
     } else gdk_rgba_parse (&c->high_throttle_color, "red");
 
+    if (config_setting_lookup_string (settings, "Frequency", &str))
+    {
+        if (!gdk_rgba_parse (&c->freq_color, str))
+            gdk_rgba_parse (&c->freq_color, "blue");
+    } else gdk_rgba_parse (&c->freq_color, "blue");
+
+    if (config_setting_lookup_int (settings, "ShowFrequency", &val))
+        c->show_freq = (val != 0);
+    else c->show_freq = TRUE;
+
     if (config_setting_lookup_int (settings, "LowTemp", &val))
     {
         if (val >= 0 && val <= 100) c->lower_temp = val;
@@ -562,22 +4156,130 @@ static GtkWidget *cpu_constructor (LXPanel *panel, config_setting_t *settings)
         else c->upper_temp = 90;
     }
     else c->upper_temp = 90;
+    c->view_lower = c->lower_temp;
+    c->view_upper = c->upper_temp;
+
+    if (config_setting_lookup_int (settings, "AutoScale", &val))
+        c->auto_scale = (val != 0);
+
+    if (config_setting_lookup_int (settings, "SaveHistory", &val))
+        c->save_history = (val != 0);
+    else c->save_history = FALSE;
+
+    if (config_setting_lookup_int (settings, "ReadBackend", &val) && val >= 0 && val < NUM_BACKENDS)
+        c->read_backend = val;
+
+    /* Sensors combined into the reading shown, and how */
+    if (config_setting_lookup_int (settings, "SensorPolicy", &val) && val >= 0 && val < NUM_POLICIES)
+        c->sensor_policy = val;
+    if (config_setting_lookup_string (settings, "Sensors", &str)) c->sensor_select = g_strdup (str);
+    else c->sensor_select = g_strdup ("");
+
+    /* Set up the sampler, or share the one another instance has set up.
+     * Each instance combines the readings by its own policy; the sampler
+     * reads every sensor any instance needs, and keeps history while any
+     * instance wants it. Its other settings are read only by the instance
+     * which sets it up, and kept until the last instance sharing it has gone;
+     * of them, only the read backend can be changed later, from any instance's
+     * settings dialog. */
+    if ((c->sampler = shared_sampler)) check_shared_settings (c->sampler, settings);
+    else
+    {
+        if (!config_setting_lookup_string (settings, "SensorRoot", &root)) root = NULL;
+        if (!config_setting_lookup_string (settings, "ThrottleFile", &str)) str = NULL;
+        c->sampler = sampler_new (root, str, c->read_backend);
+
+        /* hwmon sensors other than thermal zones are only used if asked for,
+         * or if there are no thermal zones */
+        if (config_setting_lookup_int (settings, "HwmonSensors", &val)) c->sampler->hwmon = (val != 0);
+
+        /* Instrumentation, on by default as it costs little; the counters can be
+         * shown in the tooltip, and are written out on SIGUSR2 */
+        if (config_setting_lookup_int (settings, "Instrument", &val)) c->sampler->instrument = (val != 0);
+        else c->sampler->instrument = TRUE;
+
+        /* Publish samples in shared memory for other programs, unless turned off */
+        if (config_setting_lookup_int (settings, "PublishSamples", &val)) c->sampler->publish = (val != 0);
+        else c->sampler->publish = TRUE;
+
+        /* Trace replay, for testing */
+        if (config_setting_lookup_string (settings, "ReplayFile", &str))
+        {
+            if (!config_setting_lookup_int (settings, "ReplaySpeed", &val)) val = 1;
+            sampler_replay (c->sampler, str, val);
+        }
+
+        /* Metrics for node_exporter, written by the sampler so that monitoring
+         * doesn't need to read the sensors again */
+        if (config_setting_lookup_string (settings, "MetricsFile", &str))
+        {
+            if (!config_setting_lookup_int (settings, "MetricsInterval", &val) || val <= 0) val = METRICS_INTERVAL;
+            c->sampler->metrics = metrics_new (str, val);
+        }
+    }
+    shared_refs++;
+    c->client = sampler_subscribe (c->sampler, c->sensor_policy, c->sensor_select, c->save_history);
+
+    if (config_setting_lookup_int (settings, "DebugTooltip", &val)) c->debug_tooltip = (val != 0);
+    if (c->sampler->instrument) c->dump_signal = g_unix_signal_add (SIGUSR2, (GSourceFunc) dump_counters, c);
+
+    /* Trace recording, for testing */
+    if (config_setting_lookup_string (settings, "RecordFile", &str)) record_open (c, str);
+
+    if (config_setting_lookup_int (settings, "TimeScale", &val) && val >= 0 && val < NUM_SCALES)
+        c->scale = val;
 
-    /* Find the system thermal sensors */
-    check_sensors (c);
+    if (config_setting_lookup_int (settings, "SensorView", &val) && val >= 0 && val < NUM_VIEWS)
+        c->sensor_view = val;
+
+    if (config_setting_lookup_int (settings, "LabelUnits", &val) && val >= 0 && val < NUM_UNITS)
+        c->label_units = val;
+
+    if (config_setting_lookup_int (settings, "LabelSensor", &val) && val >= 0)
+        c->label_sensor = val;
+
+    /* Allocate history */
+    for (val = 0; val < NUM_TIERS; val++)
+    {
+        c->tiers[val].size = tier_spec[val].size;
+        c->tiers[val].period = tier_spec[val].period;
+        c->tiers[val].bucket = g_new0 (HistoryBucket, tier_spec[val].size);
+    }
 
     /* Connect signals. */
     g_signal_connect(G_OBJECT (c->da), "draw", G_CALLBACK (draw), (gpointer) c);
+    gtk_widget_set_has_tooltip (c->plugin, TRUE);
+    g_signal_connect (G_OBJECT (c->plugin), "query-tooltip", G_CALLBACK (query_tooltip), (gpointer) c);
+
+    /* Watch for the graph being hidden; it is taken to be visible until told otherwise. */
+    c->mapped = TRUE;
+    gtk_widget_add_events (c->da, GDK_VISIBILITY_NOTIFY_MASK);
+    g_signal_connect (G_OBJECT (c->da), "map", G_CALLBACK (da_map), (gpointer) c);
+    g_signal_connect (G_OBJECT (c->da), "unmap", G_CALLBACK (da_unmap), (gpointer) c);
+    g_signal_connect (G_OBJECT (c->da), "visibility-notify-event", G_CALLBACK (da_visibility), (gpointer) c);
+    c->cancel = g_cancellable_new ();
+    g_bus_get (G_BUS_TYPE_SESSION, c->cancel, bus_ready, c);
 
     /* Initialise buffers */
-    c->stats_cpu = NULL;
+    c->time_offset = g_get_real_time () - g_get_monotonic_time ();
     cpu_configuration_changed (panel, c->plugin);
+    g_mutex_lock (&c->sampler->lock);
+    if (c->sampler->history) load_history (c, c->sampler->history->hdr);
+    g_mutex_unlock (&c->sampler->lock);
 
-    /* Connect a timer to refresh the statistics. */
-    c->timer = g_timeout_add (1500, (GSourceFunc) cpu_update, (gpointer) c);
+    /* Watch for samples and start the sampler thread, unless it is already
+     * running for another instance. It finds the sensors in the background;
+     * until the first sample arrives the graph is empty. */
+    c->timer = g_unix_fd_add (c->client->event_fd, G_IO_IN, samples_ready, (gpointer) c);
+    if (!shared_sampler)
+    {
+        shared_sampler = c->sampler;
+        sampler_start (c->sampler);
+    }
 
     /* Show the widget and return. */
     gtk_widget_show_all (c->plugin);
+    g_message ("cputemp: Started in %.1f ms", (g_get_monotonic_time () - c->start_time) / 1000.0);
     return c->plugin;
 }
 
@@ -585,14 +4287,42 @@ static GtkWidget *cpu_constructor (LXPanel *panel, config_setting_t *settings)
 static void cpu_destructor (gpointer user_data)
 {
     CPUTempPlugin *c = (CPUTempPlugin *) user_data;
+    int i;
+
+    /* Stop watching the screensaver. */
+    g_cancellable_cancel (c->cancel);
+    g_object_unref (c->cancel);
+    if (c->bus)
+    {
+        for (i = 0; i < G_N_ELEMENTS (screensaver_interfaces); i++)
+            g_dbus_connection_signal_unsubscribe (c->bus, c->screensaver_sub[i]);
+        g_object_unref (c->bus);
+    }
 
-    /* Disconnect the timer. */
+    /* Disconnect from the sampler, and stop it if no other instance uses it. */
     g_source_remove (c->timer);
+    if (c->dump_signal) g_source_remove (c->dump_signal);
+    sampler_unsubscribe (c->sampler, c->client);
+    if (!--shared_refs)
+    {
+        sampler_free (c->sampler);
+        shared_sampler = NULL;
+    }
+    if (c->record) fclose (c->record);
 
     /* Deallocate memory. */
+    g_free (c->sensor_select);
     cairo_surface_destroy (c->pixmap);
-    g_free (c->stats_cpu);
-    g_free (c->stats_throttle);
+    cairo_surface_destroy (c->graph);
+    cairo_surface_destroy (c->overlay);
+    glyphs_free (&c->glyphs);
+    ring_free (&c->ring);
+    stats_free (&c->stats);
+    g_free (c->raster);
+    g_free (c->sensor_stats);
+    g_free (c->temperature);
+    g_free (c->sensor_ids);
+    for (i = 0; i < NUM_TIERS; i++) g_free (c->tiers[i].bucket);
     g_free (c);
 }
 
@@ -609,15 +4339,93 @@ static gboolean cpu_apply_configuration (gpointer user_data)
     config_group_set_string (c->settings, "Throttle1", colbuf);
     sprintf (colbuf, "%s", gdk_rgba_to_string (&c->high_throttle_color));
     config_group_set_string (c->settings, "Throttle2", colbuf);
+    sprintf (colbuf, "%s", gdk_rgba_to_string (&c->freq_color));
+    config_group_set_string (c->settings, "Frequency", colbuf);
+    config_group_set_int (c->settings, "ShowFrequency", c->show_freq);
     config_group_set_int (c->settings, "HighTemp", c->upper_temp);
     config_group_set_int (c->settings, "LowTemp", c->lower_temp);
+    config_group_set_int (c->settings, "AutoScale", c->auto_scale);
+    config_group_set_int (c->settings, "SaveHistory", c->save_history);
+    config_group_set_int (c->settings, "SensorView", c->sensor_view);
+    config_group_set_int (c->settings, "ReadBackend", c->read_backend);
+    config_group_set_int (c->settings, "SensorPolicy", c->sensor_policy);
+    if (!c->sensor_select) c->sensor_select = g_strdup ("");
+    config_group_set_string (c->settings, "Sensors", c->sensor_select);
+    config_group_set_int (c->settings, "LabelUnits", c->label_units);
+    config_group_set_int (c->settings, "LabelSensor", c->label_sensor);
+    sampler_set_history (c->sampler, c->client, c->save_history);
+    sampler_set_backend (c->sampler, c->read_backend);
+    sampler_set_policy (c->sampler, c->client, c->sensor_policy, c->sensor_select);
+
+    /* Colours or bounds may have changed, so redraw everything. */
+    autoscale (c);
+    c->redraw_full = TRUE;
+    redraw_pixmap (c);
     return FALSE;
 }
 
+/* The generic dialog only has number entries, so settings taking one of a
+ * set of values get a combo box of their own, added to the dialog as an
+ * external control. As with the dialog's own controls, a change is applied
+ * straight away. */
+static void choice_changed (GtkComboBox *combo, int *value)
+{
+    if (gtk_combo_box_get_active (combo) < 0) return;
+    *value = gtk_combo_box_get_active (combo);
+    cpu_apply_configuration (g_object_get_data (G_OBJECT (combo), "plugin"));
+}
+
+static GtkWidget *choice_new (GtkWidget *p, const char *label, const char * const *names, int count, int *value)
+{
+    GtkWidget *box = gtk_box_new (GTK_ORIENTATION_HORIZONTAL, 6);
+    GtkWidget *combo = gtk_combo_box_text_new ();
+    int i;
+
+    for (i = 0; i < count; i++) gtk_combo_box_text_append_text (GTK_COMBO_BOX_TEXT (combo), names[i]);
+    if (*value >= 0 && *value < count) gtk_combo_box_set_active (GTK_COMBO_BOX (combo), *value);
+    g_object_set_data (G_OBJECT (combo), "plugin", p);
+    g_signal_connect (combo, "changed", G_CALLBACK (choice_changed), value);
+
+    gtk_box_pack_start (GTK_BOX (box), gtk_label_new (label), FALSE, FALSE, 0);
+    gtk_box_pack_end (GTK_BOX (box), combo, FALSE, FALSE, 0);
+    return box;
+}
+
+/* Choice of the reading shown by the label: the combined one, or that of one
+ * of the sensors the plugin has seen, by its label in the registry. A sensor
+ * chosen before but not seen yet since starting keeps a place of its own. */
+static GtkWidget *label_choice_new (GtkWidget *p, CPUTempPlugin *c)
+{
+    CPUTempSensor *s;
+    GtkWidget *box;
+    char **names;
+    int i, count = MAX (c->numsensors, c->label_sensor) + 1;
+
+    names = g_new0 (char *, count);
+    names[0] = g_strdup (_("Combined reading"));
+    g_mutex_lock (&c->sampler->lock);
+    for (i = 1; i < count; i++)
+    {
+        s = i <= c->numsensors && i <= c->sampler->sensors->len ? g_ptr_array_index (c->sampler->sensors, i - 1) : NULL;
+        if (s && s->id == c->sensor_ids[i - 1]) names[i] = g_strdup (s->label);
+        else names[i] = g_strdup_printf (_("Sensor %d"), i);
+    }
+    g_mutex_unlock (&c->sampler->lock);
+
+    box = choice_new (p, _("Label shows"), (const char * const *) names, count, &c->label_sensor);
+    for (i = 0; i < count; i++) g_free (names[i]);
+    g_free (names);
+    return box;
+}
+
 /* Callback when the configuration dialog is to be shown. */
 static GtkWidget *cpu_configure (LXPanel *panel, GtkWidget *p)
 {
     CPUTempPlugin * dc = lxpanel_plugin_get_data(p);
+    const char *views[NUM_VIEWS] = { _("Combined reading only"), _("A line for each sensor"), _("Heat map of sensors") };
+    const char *backends[NUM_BACKENDS] = { _("One at a time"), _("Batched") };
+    const char *units[NUM_UNITS] = { _("Degrees Celsius"), _("Degrees Fahrenheit") };
+    const char *policies[NUM_POLICIES] = { _("Highest reading"), _("Mean reading"), _("Weighted mean"), _("First selected sensor") };
 
     return lxpanel_generic_config_dlg(_("CPU Temperature"), panel,
         cpu_apply_configuration, p,
@@ -625,8 +4433,18 @@ static GtkWidget *cpu_configure (LXPanel *panel, GtkWidget *p)
         _("Background colour"), &dc->background_color, CONF_TYPE_COLOR,
         _("Colour when ARM frequency capped"), &dc->low_throttle_color, CONF_TYPE_COLOR,
         _("Colour when throttled"), &dc->high_throttle_color, CONF_TYPE_COLOR,
+        _("Show CPU frequency"), &dc->show_freq, CONF_TYPE_BOOL,
+        _("CPU frequency colour"), &dc->freq_color, CONF_TYPE_COLOR,
         _("Lower temperature bound"), &dc->lower_temp, CONF_TYPE_INT,
         _("Upper temperature bound"), &dc->upper_temp, CONF_TYPE_INT,
+        _("Fit bounds to recent readings"), &dc->auto_scale, CONF_TYPE_BOOL,
+        _("Keep history across restarts"), &dc->save_history, CONF_TYPE_BOOL,
+        _("Show sensors"), choice_new (p, _("Show sensors"), views, NUM_VIEWS, &dc->sensor_view), CONF_TYPE_EXTERNAL,
+        _("Read sensors"), choice_new (p, _("Read sensors"), backends, NUM_BACKENDS, &dc->read_backend), CONF_TYPE_EXTERNAL,
+        _("Label units"), choice_new (p, _("Label units"), units, NUM_UNITS, &dc->label_units), CONF_TYPE_EXTERNAL,
+        _("Combine sensors by"), choice_new (p, _("Combine sensors by"), policies, NUM_POLICIES, &dc->sensor_policy), CONF_TYPE_EXTERNAL,
+        _("Sensors to combine (names or labels, with optional :weight; empty for all)"), &dc->sensor_select, CONF_TYPE_STR,
+        _("Label shows"), label_choice_new (p, dc), CONF_TYPE_EXTERNAL,
         NULL);
 }
 
@@ -639,5 +4457,6 @@ LXPanelPluginInit fm_module_init_lxpanel_gtk = {
     .description = N_("Display CPU temperature"),
     .new_instance = cpu_constructor,
     .reconfigure = cpu_configuration_changed,
+    .button_press_event = cpu_button_press,
     .gettext_package = GETTEXT_PACKAGE
 };